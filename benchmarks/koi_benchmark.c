@@ -0,0 +1,528 @@
+// koi_benchmark - decode/encode throughput of koi_image.h and koi_image_write.h
+//
+// usage: koi_benchmark [-r runs] [-o out.json] [file.qoi ...]
+//
+// Every operation is timed 'runs' times (5 by default) and the best time is
+// kept; a run repeats the operation until it has taken at least 20 ms, so
+// small images are measured as reliably as large ones. The results go to
+// stdout, or to out.json, as JSON.
+//
+// Without files a few synthetic images (a noisy photo-like gradient, a flat
+// UI-like RGBA capture and a greyscale scan) are generated, so numbers from
+// different commits on one machine can always be compared. To compare
+// machines, run it on a fixed corpus, e.g. the images of the QOI benchmark
+// suite converted to .qoi with qoiconv:
+//
+//    koi_benchmark -o results.json qoi_benchmark_suite/*/*.qoi
+//
+// MB/s counts the uncompressed pixel data, as returned by the decoder or
+// passed to the encoder. The encoders also report "ratio", uncompressed
+// bytes per encoded byte; encode_fastest is encode_func at effort 0 (see
+// koi_set_qoi_effort_on_write).
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "koi_image.h"
+#include "koi_image_write.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static double now_seconds(void)
+{
+#if defined(_WIN32)
+   LARGE_INTEGER f, t;
+   QueryPerformanceFrequency(&f);
+   QueryPerformanceCounter(&t);
+   return (double)t.QuadPart / (double)f.QuadPart;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#endif
+}
+
+typedef struct
+{
+   unsigned char *data;
+   int len, cap;
+} buffer;
+
+static void buffer_write(void *context, void *data, int size)
+{
+   buffer *b = (buffer*)context;
+   if (b->len + size > b->cap) {
+      int cap = b->cap ? b->cap : 4096;
+      while (cap < b->len + size)
+         cap *= 2;
+      b->data = (unsigned char*)realloc(b->data, cap);
+      if (b->data == NULL) {
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+      b->cap = cap;
+   }
+   memcpy(b->data + b->len, data, size);
+   b->len += size;
+}
+
+// the images being measured
+typedef struct
+{
+   const char *name;
+   const char *path;          // the file decode_file reads, NULL until written
+   buffer qoi;                // the file, in memory
+   unsigned char *pixels;     // decoded, 'comp' channels, for the encoders
+   int w, h, comp;
+} image;
+
+static const char *temp_path = "koi_benchmark.tmp.qoi";
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// the operations
+//
+// each returns the number of uncompressed bytes it handled, 0 on failure
+
+typedef struct
+{
+   const unsigned char *data;
+   int len, pos;
+} reader;
+
+static int reader_read(void *user, char *data, int size)
+{
+   reader *r = (reader*)user;
+   if (size > r->len - r->pos)
+      size = r->len - r->pos;
+   memcpy(data, r->data + r->pos, size);
+   r->pos += size;
+   return size;
+}
+
+static void reader_skip(void *user, int n)
+{
+   reader *r = (reader*)user;
+   r->pos += n;
+}
+
+static double decoded(void *p, int x, int y, int channels, int sample_size)
+{
+   if (p == NULL)
+      return 0;
+   koi_image_free(p);
+   return (double)x * y * channels * sample_size;
+}
+
+#define DECODE_REQ(name, req)                                                        \
+static double name(image *im)                                                      \
+{                                                                                  \
+   int x, y, n;                                                                    \
+   koi_uc *p = koi_load_from_memory(im->qoi.data, im->qoi.len, &x, &y, &n, req);   \
+   return decoded(p, x, y, req ? req : n, 1);                                      \
+}
+
+DECODE_REQ(decode_memory, 0)
+DECODE_REQ(decode_req_1, 1)
+DECODE_REQ(decode_req_2, 2)
+DECODE_REQ(decode_req_3, 3)
+DECODE_REQ(decode_req_4, 4)
+
+#undef DECODE_REQ
+
+static double decode_callbacks(image *im)
+{
+   static koi_io_callbacks const callbacks = { reader_read, reader_skip, NULL };
+   reader r;
+   int x, y, n;
+   koi_uc *p;
+   r.data = im->qoi.data;
+   r.len = im->qoi.len;
+   r.pos = 0;
+   p = koi_load_from_callbacks(&callbacks, &r, &x, &y, &n, 0);
+   return decoded(p, x, y, n, 1);
+}
+
+static double decode_file(image *im)
+{
+   int x, y, n;
+   koi_uc *p = koi_load(im->path, &x, &y, &n, 0);
+   return decoded(p, x, y, n, 1);
+}
+
+static double decode_flip(image *im)
+{
+   int x, y, n;
+   koi_uc *p;
+   koi_set_flip_vertically_on_load(1);
+   p = koi_load_from_memory(im->qoi.data, im->qoi.len, &x, &y, &n, 0);
+   koi_set_flip_vertically_on_load(0);
+   return decoded(p, x, y, n, 1);
+}
+
+static double decode_16(image *im)
+{
+   int x, y, n;
+   koi_us *p = koi_load_16_from_memory(im->qoi.data, im->qoi.len, &x, &y, &n, 0);
+   return decoded(p, x, y, n, 2);
+}
+
+static double decode_float(image *im)
+{
+   int x, y, n;
+   float *p = koi_loadf_from_memory(im->qoi.data, im->qoi.len, &x, &y, &n, 0);
+   return decoded(p, x, y, n, 4);
+}
+
+static void discard(void *context, void *data, int size)
+{
+   *(int*)context += size;
+   (void)data;
+}
+
+// the size of the last image encode_func or encode_fastest wrote
+static int encoded_len;
+
+static double encode_func(image *im)
+{
+   int len = 0;
+   if (!koi_write_qoi_to_func(discard, &len, im->w, im->h, im->comp, im->pixels))
+      return 0;
+   encoded_len = len;
+   return (double)im->w * im->h * im->comp;
+}
+
+static double encode_fastest(image *im)
+{
+   double bytes;
+   koi_set_qoi_effort_on_write(0);
+   bytes = encode_func(im);
+   koi_set_qoi_effort_on_write(1);
+   return bytes;
+}
+
+static double encode_file(image *im)
+{
+   if (!koi_write_qoi(temp_path, im->w, im->h, im->comp, im->pixels))
+      return 0;
+   return (double)im->w * im->h * im->comp;
+}
+
+typedef struct
+{
+   const char *name;
+   double (*run)(image *im);
+   const char *(*failure_reason)(void); // of the library 'run' calls
+} operation;
+
+static const operation operations[] =
+{
+   { "decode_memory",    decode_memory,    koi_failure_reason },
+   { "decode_callbacks", decode_callbacks, koi_failure_reason },
+   { "decode_file",      decode_file,      koi_failure_reason },
+   { "decode_req_1",     decode_req_1,     koi_failure_reason },
+   { "decode_req_2",     decode_req_2,     koi_failure_reason },
+   { "decode_req_3",     decode_req_3,     koi_failure_reason },
+   { "decode_req_4",     decode_req_4,     koi_failure_reason },
+   { "decode_flip",      decode_flip,      koi_failure_reason },
+   { "decode_16",        decode_16,        koi_failure_reason },
+   { "decode_float",     decode_float,     koi_failure_reason },
+   { "encode_func",      encode_func,      koiw_failure_reason },
+   { "encode_fastest",   encode_fastest,   koiw_failure_reason },
+   { "encode_file",      encode_file,      koiw_failure_reason },
+};
+
+#define OPERATION_COUNT ((int)(sizeof(operations) / sizeof(operations[0])))
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// input
+//
+
+static unsigned int rng_state = 12345;
+
+static unsigned int rng(void)
+{
+   rng_state = rng_state * 1103515245u + 12345u;
+   return rng_state >> 16;
+}
+
+// smooth gradients with a little noise, like a photo
+static void fill_photo(unsigned char *p, int w, int h, int comp)
+{
+   int x, y, c;
+   for (y = 0; y < h; ++y)
+      for (x = 0; x < w; ++x)
+         for (c = 0; c < comp; ++c)
+            *p++ = (unsigned char)((x * (c + 1) / 7 + y * (3 - c) / 5 + rng() % 5) & 0xff);
+}
+
+// flat rectangles with sharp edges and a few anti-aliased ones, like a screenshot
+static void fill_ui(unsigned char *p, int w, int h, int comp)
+{
+   int x, y, c;
+   for (y = 0; y < h; ++y)
+      for (x = 0; x < w; ++x) {
+         int cell = (x / 97) * 31 + (y / 41) * 17;
+         int edge = (x % 97 == 0) || (y % 41 == 0);
+         for (c = 0; c < comp; ++c) {
+            unsigned char v = (unsigned char)(cell * (c + 3) & 0xff);
+            if (edge)
+               v = (unsigned char)(v ^ (rng() & 0x3f));
+            if (c == 3)
+               v = (unsigned char)((cell & 3) ? 255 : (x + y) & 0xff);
+            *p++ = v;
+         }
+      }
+}
+
+static int add_synthetic(image *im, const char *name, int w, int h, int comp, void (*fill)(unsigned char *p, int w, int h, int comp))
+{
+   memset(im, 0, sizeof(*im));
+   im->name = name;
+   im->w = w;
+   im->h = h;
+   im->comp = comp;
+   im->pixels = (unsigned char*)malloc((size_t)w * h * comp);
+   if (im->pixels == NULL)
+      return 0;
+   fill(im->pixels, w, h, comp);
+   return koi_write_qoi_to_func(buffer_write, &im->qoi, w, h, comp, im->pixels);
+}
+
+// NULL on success, or why the file can't be used
+static const char *add_file(image *im, const char *path)
+{
+   FILE *f;
+   char chunk[65536];
+   size_t n;
+
+   memset(im, 0, sizeof(*im));
+   im->name = path;
+   im->path = path;
+   f = fopen(path, "rb");
+   if (f == NULL)
+      return "can't open";
+   while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+      buffer_write(&im->qoi, chunk, (int)n);
+   fclose(f);
+   im->pixels = koi_load_from_memory(im->qoi.data, im->qoi.len, &im->w, &im->h, &im->comp, 0);
+   if (im->pixels == NULL) {
+      free(im->qoi.data);
+      return koi_failure_reason();
+   }
+   return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// measuring and reporting
+//
+
+typedef struct
+{
+   double seconds; // best time for one operation
+   double bytes;   // uncompressed bytes it handled
+   double encoded; // bytes it encoded them to, 0 for the decoders
+} timing;
+
+static int measure(image *im, const operation *op, int runs, timing *t)
+{
+   int r, i, reps;
+   double start, elapsed;
+
+   // warm up, and find how many repetitions make a run long enough
+   encoded_len = 0;
+   start = now_seconds();
+   t->bytes = op->run(im);
+   elapsed = now_seconds() - start;
+   if (t->bytes == 0)
+      return 0;
+   t->encoded = encoded_len;
+   reps = elapsed < 0.02 ? (int)(0.02 / (elapsed > 1e-7 ? elapsed : 1e-7)) + 1 : 1;
+
+   t->seconds = 1e30;
+   for (r = 0; r < runs; ++r) {
+      start = now_seconds();
+      for (i = 0; i < reps; ++i)
+         op->run(im);
+      elapsed = (now_seconds() - start) / reps;
+      if (elapsed < t->seconds)
+         t->seconds = elapsed;
+   }
+   return 1;
+}
+
+static void json_string(FILE *out, const char *s)
+{
+   fputc('"', out);
+   for (; *s; ++s) {
+      if (*s == '"' || *s == '\\')
+         fprintf(out, "\\%c", *s);
+      else if ((unsigned char)*s < 0x20)
+         fprintf(out, "\\u%04x", (unsigned char)*s);
+      else
+         fputc(*s, out);
+   }
+   fputc('"', out);
+}
+
+static void json_timing(FILE *out, double pixels, const timing *t)
+{
+   fprintf(out, "\"ms\": %.4f, \"mpixels_per_s\": %.2f, \"mb_per_s\": %.2f",
+      t->seconds * 1e3, pixels / t->seconds * 1e-6, t->bytes / t->seconds * 1e-6);
+   if (t->encoded > 0)
+      fprintf(out, ", \"ratio\": %.3f", t->bytes / t->encoded);
+}
+
+int main(int argc, char **argv)
+{
+   const char *out_path = NULL;
+   FILE *out = stdout;
+   image *images;
+   timing *t, total[OPERATION_COUNT];
+   double total_pixels = 0;
+   int ok[OPERATION_COUNT];
+   int runs = 5, count = 0, i, o, a;
+
+   for (a = 1; a < argc && argv[a][0] == '-'; ++a) {
+      if (strcmp(argv[a], "-r") == 0 && a + 1 < argc)
+         runs = atoi(argv[++a]);
+      else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+         out_path = argv[++a];
+      else {
+         fprintf(stderr, "usage: %s [-r runs] [-o out.json] [file.qoi ...]\n", argv[0]);
+         return 2;
+      }
+   }
+   if (runs < 1)
+      runs = 1;
+
+   images = (image*)malloc(sizeof(image) * (argc - a > 3 ? argc - a : 3));
+   t = (timing*)malloc(sizeof(timing) * OPERATION_COUNT * (argc - a > 3 ? argc - a : 3));
+   if (images == NULL || t == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   if (a == argc) {
+      count = add_synthetic(&images[0], "synthetic_photo_rgb", 1920, 1080, 3, fill_photo)
+           && add_synthetic(&images[1], "synthetic_ui_rgba", 1920, 1080, 4, fill_ui)
+           && add_synthetic(&images[2], "synthetic_scan_grey", 2048, 2048, 1, fill_photo) ? 3 : 0;
+      if (count == 0) {
+         fprintf(stderr, "couldn't create the synthetic images\n");
+         return 1;
+      }
+      // decode_file reads the image back from disk
+      for (i = 0; i < count; ++i)
+         images[i].path = temp_path;
+   }
+   else {
+      for (; a < argc; ++a) {
+         const char *error = add_file(&images[count], argv[a]);
+         if (error == NULL)
+            ++count;
+         else
+            fprintf(stderr, "skipping %s: %s\n", argv[a], error);
+      }
+      if (count == 0)
+         return 1;
+   }
+
+   for (o = 0; o < OPERATION_COUNT; ++o) {
+      total[o].seconds = total[o].bytes = total[o].encoded = 0;
+      ok[o] = 1;
+   }
+   for (i = 0; i < count; ++i) {
+      image *im = &images[i];
+      if (im->path == temp_path) {
+         FILE *f = fopen(temp_path, "wb");
+         if (f == NULL || fwrite(im->qoi.data, 1, im->qoi.len, f) != (size_t)im->qoi.len) {
+            fprintf(stderr, "can't write %s\n", temp_path);
+            return 1;
+         }
+         fclose(f);
+      }
+      for (o = 0; o < OPERATION_COUNT; ++o) {
+         timing *r = &t[i * OPERATION_COUNT + o];
+         if (!measure(im, &operations[o], runs, r)) {
+            fprintf(stderr, "%s failed on %s: %s\n", operations[o].name, im->name, operations[o].failure_reason());
+            r->seconds = 0;
+            ok[o] = 0;
+            continue;
+         }
+         total[o].seconds += r->seconds;
+         total[o].bytes += r->bytes;
+         total[o].encoded += r->encoded;
+      }
+      total_pixels += (double)im->w * im->h;
+   }
+   remove(temp_path);
+
+   if (out_path) {
+      out = fopen(out_path, "w");
+      if (out == NULL) {
+         fprintf(stderr, "can't write %s\n", out_path);
+         return 1;
+      }
+   }
+
+   fprintf(out, "{\n  \"runs\": %d,\n  \"images\": [\n", runs);
+   for (i = 0; i < count; ++i) {
+      image *im = &images[i];
+      fprintf(out, "    {\"name\": ");
+      json_string(out, im->name);
+      fprintf(out, ", \"width\": %d, \"height\": %d, \"channels\": %d, \"qoi_bytes\": %d, \"results\": {\n",
+         im->w, im->h, im->comp, im->qoi.len);
+      for (o = 0; o < OPERATION_COUNT; ++o) {
+         timing *r = &t[i * OPERATION_COUNT + o];
+         fprintf(out, "      \"%s\": ", operations[o].name);
+         if (r->seconds > 0) {
+            fputc('{', out);
+            json_timing(out, (double)im->w * im->h, r);
+            fputc('}', out);
+         }
+         else
+            fprintf(out, "null");
+         fprintf(out, o + 1 < OPERATION_COUNT ? ",\n" : "\n");
+      }
+      fprintf(out, "    }}%s\n", i + 1 < count ? "," : "");
+   }
+   // the whole set, as if it were one image
+   fprintf(out, "  ],\n  \"total\": {\n");
+   for (o = 0; o < OPERATION_COUNT; ++o) {
+      fprintf(out, "    \"%s\": ", operations[o].name);
+      if (ok[o]) {
+         fputc('{', out);
+         json_timing(out, total_pixels, &total[o]);
+         fputc('}', out);
+      }
+      else
+         fprintf(out, "null");
+      fprintf(out, o + 1 < OPERATION_COUNT ? ",\n" : "\n");
+   }
+   fprintf(out, "  }\n}\n");
+
+   if (out != stdout)
+      fclose(out);
+   for (i = 0; i < count; ++i) {
+      free(images[i].qoi.data);
+      if (images[i].path == temp_path)
+         free(images[i].pixels);
+      else
+         koi_image_free(images[i].pixels);
+   }
+   free(images);
+   free(t);
+   return 0;
+}
@@ -0,0 +1,535 @@
+/* koi.hpp - public domain C++ wrapper for koi_image.h and koi_image_write.h
+                                    https://github.com/Muppetsg2/koi
+                                    no warranty implied; use at your own risk
+
+   Header only, C++17 or newer; std::span is used when the standard library
+   has it (C++20), a minimal koi::span with the same interface otherwise.
+   It only declares inline functions on top of the C API, so the
+   implementations are still created in *one* C or C++ file as usual:
+
+      #define KOI_IMAGE_IMPLEMENTATION
+      #define KOI_IMAGE_WRITE_IMPLEMENTATION
+      #include "koi_image.h"
+      #include "koi_image_write.h"
+
+   or by linking the koi library built by CMake. When KOI_ENABLE_IMAGE or
+   KOI_ENABLE_IMAGE_WRITE is defined (the CMake target does that) only the
+   enabled halves are wrapped, otherwise both are.
+
+
+   QUICK NOTES:
+
+      std::vector<unsigned char> file = ...;
+      koi::result<koi::image> r = koi::load(file, 4);
+      if (!r) { puts(r.error()); return; }
+      koi::image img = std::move(r).value();   // frees itself
+      draw(img.data(), img.width(), img.height());
+
+      // straight into your own buffer, no allocation at all
+      koi::result<koi::image_info> i = koi::decode_into(file, texture_memory, 4);
+
+      // and back
+      std::vector<unsigned char> out;
+      koi::result<std::size_t> n = koi::encode(out, img.view());
+      koi::result<std::size_t> m = koi::encode_into(fixed_buffer, img.view());
+
+   Nothing throws; every call returns a koi::result holding either the value
+   or the failure reason, taken from koi_failure_reason()/koiw_failure_reason()
+   as soon as the C call returns. The strings are the same string literals,
+   so they stay valid.
+
+   koi::image frees its pixels with koi_image_free, which uses the allocator
+   set by koi_set_allocator(_thread) at that point. As with the C API, keep the
+   same allocator set while the image is alive, or release() the pixels and
+   free them yourself.
+
+
+LICENSE
+
+   See end of file for license information.
+
+*/
+
+#ifndef KOI_INCLUDE_KOI_HPP
+#define KOI_INCLUDE_KOI_HPP
+
+#if !defined(KOI_ENABLE_IMAGE) && !defined(KOI_ENABLE_IMAGE_WRITE)
+   #define KOI_HPP_IMAGE
+   #define KOI_HPP_IMAGE_WRITE
+#else
+   #if defined(KOI_ENABLE_IMAGE)
+      #define KOI_HPP_IMAGE
+   #endif
+   #if defined(KOI_ENABLE_IMAGE_WRITE)
+      #define KOI_HPP_IMAGE_WRITE
+   #endif
+#endif
+
+#if defined(KOI_HPP_IMAGE)
+#include "koi_image.h"
+#endif
+#if defined(KOI_HPP_IMAGE_WRITE)
+#include "koi_image_write.h"
+#endif
+
+#include <cstddef>
+#include <climits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <new>
+
+#if defined(__has_include)
+   #if __has_include(<version>)
+      #include <version>
+   #endif
+#endif
+#if defined(__cpp_lib_span) && __cpp_lib_span >= 202002L
+   #include <span>
+#endif
+
+namespace koi
+{
+
+#if defined(__cpp_lib_span) && __cpp_lib_span >= 202002L
+using std::span;
+#else
+// just enough of std::span for the calls below
+template <class T>
+class span
+{
+public:
+   constexpr span() noexcept : data_(nullptr), size_(0) {}
+   constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+   template <std::size_t N>
+   constexpr span(T (&a)[N]) noexcept : data_(a), size_(N) {}
+   // any contiguous container, std::vector and std::array included
+   template <class C, class = decltype(static_cast<T*>(std::declval<C&>().data()))>
+   constexpr span(C &&c) noexcept : data_(c.data()), size_(c.size()) {}
+   template <class U, class = decltype(static_cast<T*>(std::declval<U*>()))>
+   constexpr span(span<U> s) noexcept : data_(s.data()), size_(s.size()) {}
+
+   constexpr T *data() const noexcept { return data_; }
+   constexpr std::size_t size() const noexcept { return size_; }
+   constexpr std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+   constexpr bool empty() const noexcept { return size_ == 0; }
+   constexpr T *begin() const noexcept { return data_; }
+   constexpr T *end() const noexcept { return data_ + size_; }
+   constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+   T *data_;
+   std::size_t size_;
+};
+#endif
+
+// the layout of a pixel in memory
+struct format
+{
+   int channels;          // 1 grey, 2 grey+alpha, 3 rgb, 4 rgba
+   int bits_per_channel;  // 8, 16 or 32 (float)
+
+   constexpr int bytes_per_pixel() const noexcept { return channels * bits_per_channel / 8; }
+   constexpr std::size_t row_bytes(int width) const noexcept { return (std::size_t)width * bytes_per_pixel(); }
+   constexpr std::size_t image_bytes(int width, int height) const noexcept { return row_bytes(width) * (std::size_t)height; }
+   constexpr bool has_alpha() const noexcept { return channels == 2 || channels == 4; }
+   constexpr bool operator==(format o) const noexcept { return channels == o.channels && bits_per_channel == o.bits_per_channel; }
+   constexpr bool operator!=(format o) const noexcept { return !(*this == o); }
+};
+
+inline constexpr format grey8        { 1, 8 };
+inline constexpr format grey_alpha8  { 2, 8 };
+inline constexpr format rgb8         { 3, 8 };
+inline constexpr format rgba8        { 4, 8 };
+inline constexpr format grey16       { 1, 16 };
+inline constexpr format grey_alpha16 { 2, 16 };
+inline constexpr format rgb16        { 3, 16 };
+inline constexpr format rgba16       { 4, 16 };
+inline constexpr format greyf        { 1, 32 };
+inline constexpr format grey_alphaf  { 2, 32 };
+inline constexpr format rgbf         { 3, 32 };
+inline constexpr format rgbaf        { 4, 32 };
+
+// a value, or the reason there isn't one
+template <class T>
+class result
+{
+public:
+   result(T value) noexcept : value_(std::move(value)), error_(nullptr) {}
+   static result failure(const char *reason) noexcept { return result(reason ? reason : "unknown error", 0); }
+
+   bool ok() const noexcept { return error_ == nullptr; }
+   explicit operator bool() const noexcept { return error_ == nullptr; }
+   // NULL when ok()
+   const char *error() const noexcept { return error_; }
+
+   T &value() & noexcept { return value_; }
+   const T &value() const & noexcept { return value_; }
+   T &&value() && noexcept { return std::move(value_); }
+   T *operator->() noexcept { return &value_; }
+   const T *operator->() const noexcept { return &value_; }
+
+private:
+   result(const char *reason, int) noexcept : value_(), error_(reason) {}
+
+   T value_;
+   const char *error_;
+};
+
+// pixels somebody else owns, as the encoder takes them
+struct image_view
+{
+   const void *data = nullptr;
+   int width = 0, height = 0, channels = 0;
+   int stride_in_bytes = 0; // 0 for tightly packed rows
+};
+
+namespace detail
+{
+   inline bool fits_int(std::size_t n) noexcept { return n <= (std::size_t)INT_MAX; }
+}
+
+struct image_info
+{
+   int width = 0, height = 0;
+   int channels_in_file = 0;
+};
+
+#if defined(KOI_HPP_IMAGE)
+
+// the result of a load, freed with koi_image_free. movable, not copyable
+template <class T>
+class basic_image
+{
+public:
+   typedef T sample_type;
+
+   basic_image() noexcept : data_(nullptr), width_(0), height_(0), channels_(0), channels_in_file_(0) {}
+   // takes over 'data' from one of the koi_load functions
+   basic_image(T *data, int width, int height, int channels, int channels_in_file) noexcept
+      : data_(data), width_(width), height_(height), channels_(channels), channels_in_file_(channels_in_file) {}
+   basic_image(basic_image &&o) noexcept
+      : data_(o.data_), width_(o.width_), height_(o.height_), channels_(o.channels_), channels_in_file_(o.channels_in_file_)
+   {
+      o.data_ = nullptr;
+   }
+   basic_image &operator=(basic_image &&o) noexcept
+   {
+      if (this != &o) {
+         reset();
+         data_ = o.data_;
+         width_ = o.width_;
+         height_ = o.height_;
+         channels_ = o.channels_;
+         channels_in_file_ = o.channels_in_file_;
+         o.data_ = nullptr;
+      }
+      return *this;
+   }
+   basic_image(const basic_image &) = delete;
+   basic_image &operator=(const basic_image &) = delete;
+   ~basic_image() { reset(); }
+
+   void reset() noexcept
+   {
+      koi_image_free(data_);
+      data_ = nullptr;
+      width_ = height_ = channels_ = channels_in_file_ = 0;
+   }
+   // hand the pixels over, to be freed with koi_image_free
+   T *release() noexcept
+   {
+      T *p = data_;
+      data_ = nullptr;
+      width_ = height_ = channels_ = channels_in_file_ = 0;
+      return p;
+   }
+
+   explicit operator bool() const noexcept { return data_ != nullptr; }
+   T *data() noexcept { return data_; }
+   const T *data() const noexcept { return data_; }
+   int width() const noexcept { return width_; }
+   int height() const noexcept { return height_; }
+   int channels() const noexcept { return channels_; }
+   int channels_in_file() const noexcept { return channels_in_file_; }
+   koi::format format() const noexcept { return koi::format { channels_, (int)sizeof(T) * 8 }; }
+   std::size_t size() const noexcept { return data_ ? (std::size_t)width_ * height_ * channels_ : 0; }
+   std::size_t size_bytes() const noexcept { return size() * sizeof(T); }
+   span<T> pixels() noexcept { return span<T>(data_, size()); }
+   span<const T> pixels() const noexcept { return span<const T>(data_, size()); }
+   // the encoder only takes 8-bit samples
+   image_view view() const noexcept
+   {
+      static_assert(std::is_same<T, koi_uc>::value, "only 8-bit images can be encoded");
+      image_view v;
+      v.data = data_;
+      v.width = width_;
+      v.height = height_;
+      v.channels = channels_;
+      return v;
+   }
+
+private:
+   T *data_;
+   int width_, height_, channels_, channels_in_file_;
+};
+
+typedef basic_image<koi_uc> image;
+typedef basic_image<koi_us> image16;
+#if !defined(KOI_NO_LINEAR)
+typedef basic_image<float>  imagef;
+#endif
+
+namespace detail
+{
+   template <class T>
+   inline result<basic_image<T> > wrap(T *p, int x, int y, int n, int desired_channels) noexcept
+   {
+      if (p == nullptr)
+         return result<basic_image<T> >::failure(koi_failure_reason());
+      return basic_image<T>(p, x, y, desired_channels ? desired_channels : n, n);
+   }
+}
+
+inline result<image_info> info(span<const koi_uc> file) noexcept
+{
+   image_info i;
+   if (!detail::fits_int(file.size()))
+      return result<image_info>::failure("too large");
+   if (!koi_info_from_memory(file.data(), (int)file.size(), &i.width, &i.height, &i.channels_in_file))
+      return result<image_info>::failure(koi_failure_reason());
+   return i;
+}
+
+// 'desired_channels' 0 keeps the channels of the file
+inline result<image> load(span<const koi_uc> file, int desired_channels = 0) noexcept
+{
+   int x, y, n;
+   if (!detail::fits_int(file.size()))
+      return result<image>::failure("too large");
+   koi_uc *p = koi_load_from_memory(file.data(), (int)file.size(), &x, &y, &n, desired_channels);
+   return detail::wrap(p, x, y, n, desired_channels);
+}
+
+inline result<image16> load_16(span<const koi_uc> file, int desired_channels = 0) noexcept
+{
+   int x, y, n;
+   if (!detail::fits_int(file.size()))
+      return result<image16>::failure("too large");
+   koi_us *p = koi_load_16_from_memory(file.data(), (int)file.size(), &x, &y, &n, desired_channels);
+   return detail::wrap(p, x, y, n, desired_channels);
+}
+
+#if !defined(KOI_NO_LINEAR)
+inline result<imagef> loadf(span<const koi_uc> file, int desired_channels = 0) noexcept
+{
+   int x, y, n;
+   if (!detail::fits_int(file.size()))
+      return result<imagef>::failure("too large");
+   float *p = koi_loadf_from_memory(file.data(), (int)file.size(), &x, &y, &n, desired_channels);
+   return detail::wrap(p, x, y, n, desired_channels);
+}
+#endif
+
+// decode into 'dst', rows 'stride_in_bytes' apart (0 for packed rows),
+// without allocating anything for the result
+inline result<image_info> decode_into(span<const koi_uc> file, span<koi_uc> dst, int desired_channels = 0, int stride_in_bytes = 0) noexcept
+{
+   image_info i;
+   if (!detail::fits_int(file.size()))
+      return result<image_info>::failure("too large");
+   if (!koi_load_into_from_memory(file.data(), (int)file.size(), dst.data(), stride_in_bytes, detail::fits_int(dst.size()) ? (int)dst.size() : INT_MAX,
+                                  &i.width, &i.height, &i.channels_in_file, desired_channels))
+      return result<image_info>::failure(koi_failure_reason());
+   return i;
+}
+
+inline result<image_info> decode_into(span<const koi_uc> file, span<koi_us> dst, int desired_channels = 0, int stride_in_bytes = 0) noexcept
+{
+   image_info i;
+   std::size_t bytes = dst.size() * sizeof(koi_us);
+   if (!detail::fits_int(file.size()))
+      return result<image_info>::failure("too large");
+   if (!koi_load_16_into_from_memory(file.data(), (int)file.size(), dst.data(), stride_in_bytes, detail::fits_int(bytes) ? (int)bytes : INT_MAX,
+                                     &i.width, &i.height, &i.channels_in_file, desired_channels))
+      return result<image_info>::failure(koi_failure_reason());
+   return i;
+}
+
+#if !defined(KOI_NO_LINEAR)
+inline result<image_info> decode_into(span<const koi_uc> file, span<float> dst, int desired_channels = 0, int stride_in_bytes = 0) noexcept
+{
+   image_info i;
+   std::size_t bytes = dst.size() * sizeof(float);
+   if (!detail::fits_int(file.size()))
+      return result<image_info>::failure("too large");
+   if (!koi_loadf_into_from_memory(file.data(), (int)file.size(), dst.data(), stride_in_bytes, detail::fits_int(bytes) ? (int)bytes : INT_MAX,
+                                   &i.width, &i.height, &i.channels_in_file, desired_channels))
+      return result<image_info>::failure(koi_failure_reason());
+   return i;
+}
+#endif
+
+#if !defined(KOI_NO_STDIO)
+inline result<image> load(const char *filename, int desired_channels = 0) noexcept
+{
+   int x, y, n;
+   koi_uc *p = koi_load(filename, &x, &y, &n, desired_channels);
+   return detail::wrap(p, x, y, n, desired_channels);
+}
+
+inline result<image16> load_16(const char *filename, int desired_channels = 0) noexcept
+{
+   int x, y, n;
+   koi_us *p = koi_load_16(filename, &x, &y, &n, desired_channels);
+   return detail::wrap(p, x, y, n, desired_channels);
+}
+
+#if !defined(KOI_NO_LINEAR)
+inline result<imagef> loadf(const char *filename, int desired_channels = 0) noexcept
+{
+   int x, y, n;
+   float *p = koi_loadf(filename, &x, &y, &n, desired_channels);
+   return detail::wrap(p, x, y, n, desired_channels);
+}
+#endif
+
+inline result<image_info> info(const char *filename) noexcept
+{
+   image_info i;
+   if (!koi_info(filename, &i.width, &i.height, &i.channels_in_file))
+      return result<image_info>::failure(koi_failure_reason());
+   return i;
+}
+#endif // !KOI_NO_STDIO
+
+#endif // KOI_HPP_IMAGE
+
+#if defined(KOI_HPP_IMAGE_WRITE)
+
+// the most bytes encode_into can need for 'v', 0 if it is too large
+inline std::size_t encode_bound(const image_view &v) noexcept
+{
+   int n = koi_write_qoi_bound(v.width, v.height, v.channels);
+   return n > 0 ? (std::size_t)n : 0;
+}
+
+// encode 'v' into 'dst', returns the number of bytes written. nothing is
+// allocated unless stripes are turned on for this thread
+inline result<std::size_t> encode_into(span<koiw_uc> dst, const image_view &v) noexcept
+{
+   int n = koi_write_qoi_stride_to_memory(dst.data(), detail::fits_int(dst.size()) ? (int)dst.size() : INT_MAX, v.width, v.height, v.channels, v.data, v.stride_in_bytes);
+   if (n <= 0)
+      return result<std::size_t>::failure(koiw_failure_reason());
+   return (std::size_t)n;
+}
+
+namespace detail
+{
+   struct vector_sink
+   {
+      std::vector<koiw_uc> *out;
+      bool failed;
+   };
+
+   // the C encoder calls this, so nothing may be thrown through it
+   inline void vector_write(void *context, void *data, int size) noexcept
+   {
+      vector_sink *s = (vector_sink*)context;
+      const koiw_uc *p = (const koiw_uc*)data;
+      if (s->failed)
+         return;
+      try {
+         s->out->insert(s->out->end(), p, p + size);
+      }
+      catch (...) {
+         s->failed = true;
+      }
+   }
+}
+
+// append the encoded image to 'out', returns the number of bytes added.
+// the bound is reserved up front, so 'out' grows at most once
+inline result<std::size_t> encode(std::vector<koiw_uc> &out, const image_view &v) noexcept
+{
+   detail::vector_sink s = { &out, false };
+   std::size_t before = out.size(), bound = encode_bound(v);
+   if (bound != 0) {
+      try {
+         out.reserve(before + bound);
+      }
+      catch (...) {
+         return result<std::size_t>::failure("outofmem");
+      }
+   }
+   if (!koi_write_qoi_stride_to_func(detail::vector_write, &s, v.width, v.height, v.channels, v.data, v.stride_in_bytes)) {
+      out.resize(before);
+      return result<std::size_t>::failure(koiw_failure_reason());
+   }
+   if (s.failed) {
+      out.resize(before);
+      return result<std::size_t>::failure("outofmem");
+   }
+   return out.size() - before;
+}
+
+#if !defined(KOI_WRITE_NO_STDIO)
+inline result<bool> write(const char *filename, const image_view &v) noexcept
+{
+   if (!koi_write_qoi_stride(filename, v.width, v.height, v.channels, v.data, v.stride_in_bytes))
+      return result<bool>::failure(koiw_failure_reason());
+   return true;
+}
+#endif
+
+#endif // KOI_HPP_IMAGE_WRITE
+
+} // namespace koi
+
+#endif // KOI_INCLUDE_KOI_HPP
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2025 Marceli Antosik
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (https://unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+For more information, please refer to <https://unlicense.org>
+------------------------------------------------------------------------------
+*/
\ No newline at end of file
@@ -103,6 +103,158 @@ RECENT REVISION HISTORY:
 //   // returns ok=1 and sets x, y, n if image is a supported format,
 //   // 0 otherwise.
 //
+// If you already own the memory the pixels should end up in (an upload or
+// staging buffer, say), the koi_load_into family decodes straight into it
+// instead of allocating the result:
+//
+//   int x,y,n,ok;
+//   koi_info_from_memory(buffer, len, &x, &y, &n);
+//   // ... get a buffer 'dst' of at least (y-1)*stride + x*4 bytes ...
+//   ok = koi_load_into_from_memory(buffer, len, dst, stride, capacity, &x, &y, &n, 4);
+//
+// Rows are written 'stride_in_bytes' apart, or tightly packed if it is 0, and
+// the call fails without writing anything if the image does not fit into
+// 'dst_capacity' bytes. There are 16-bit and float versions as well, in which
+// case stride and capacity are still in bytes. Nothing is allocated for the
+// result, so there is nothing to koi_image_free afterwards.
+//
+// QOI streams can also be decoded as they arrive, e.g. from a socket, with
+// memory bounded by a single row instead of the whole image:
+//
+//   koi_qoi_decoder *d = koi_qoi_decoder_init(4);
+//   while (... more bytes arrive ...) {
+//      koi_qoi_decoder_feed(d, bytes, len);
+//      rows = koi_qoi_decoder_next_rows(d, dst, stride, max_rows);
+//      // ... 'rows' more rows are in dst, 0 if it needs more input ...
+//   }
+//   koi_qoi_decoder_free(d);
+//
+// koi_qoi_decoder_feed copies the bytes it is given, so they can be reused
+// right away; it returns 0 if the stream turned out to be corrupt. Once
+// enough bytes for the header have arrived, koi_qoi_decoder_info reports the
+// size of the image. koi_qoi_decoder_next_rows writes up to 'max_rows'
+// complete rows to 'dst', 'stride_in_bytes' apart (0 = tightly packed), and
+// returns how many it wrote, or -1 on error. The decoder keeps a partially
+// decoded row and any incomplete chunk between calls. Input it has not
+// decoded yet stays buffered, so pull rows after each feed to keep memory
+// small. Rows always come out top to bottom, regardless of
+// koi_set_flip_vertically_on_load.
+//
+// Nothing in koi_qoi_decoder blocks or calls back, so it also works for
+// reads that complete later (io_uring, IOCP, a coroutine awaiting a socket),
+// with many decodes in flight on a few threads. Have the read land right in
+// the decoder's input buffer instead of copying it there with feed:
+//
+//   // whenever the decode is resumed
+//   rows_done += koi_qoi_decoder_next_rows(d, dst + rows_done * stride, stride, h - rows_done);
+//   want = koi_qoi_decoder_wanted(d);
+//   if (want > 0) {
+//      buf = koi_qoi_decoder_buffer(d, want > 65536 ? want : 65536);
+//      // ... start an asynchronous read of up to 65536 bytes into buf ...
+//   }
+//   // and when that read completes with 'got' bytes
+//   koi_qoi_decoder_commit(d, got);
+//
+// koi_qoi_decoder_wanted says how many more bytes the decoder needs before
+// koi_qoi_decoder_next_rows can go on: 14 minus what it has until the header
+// is there, then what is missing of the next chunk (at least 1). It returns
+// 0 when it needs nothing, because every row has been taken out or there are
+// rows to take out right now, and -1 after an error. It is a lower bound;
+// reading more at once is fine and usually cheaper. koi_qoi_decoder_buffer
+// returns room for 'len' more bytes, valid until the next call with 'd'
+// (NULL only on failure, also for 'len' 0), and koi_qoi_decoder_commit adds
+// the first 'len' of them (0 if the read failed or came to nothing). feed is
+// exactly buffer, memcpy and commit, so feeding 0 bytes is fine too.
+//
+// Frame sequences written with koi_qoi_anim_begin (see koi_image_write.h),
+// where each frame continues the QOI state of the one before it and only
+// stores the rows that changed, are read back with:
+//
+//   koi_qoi_anim *a = koi_qoi_anim_open_memory(buffer, len, 4);
+//   koi_qoi_anim_info(a, &x, &y, &n, &frames);
+//   for (i = 0; i < frames; ++i) {
+//      koi_uc const *pixels = koi_qoi_anim_frame(a, i);
+//      // ... x*y*4 bytes, valid until the next call with 'a' ...
+//   }
+//   koi_qoi_anim_close(a);
+//
+// 'buffer' is not copied and has to stay around until koi_qoi_anim_close.
+// Going from one frame to the next decodes only that frame. Any other
+// frame can be asked for as well, using the table of frame offsets at the
+// end of the file; decoding then starts at the closest key frame before
+// it. Frames come out top to bottom; flip-on-load doesn't apply. Plain QOI
+// files aren't animations and are loaded the usual way.
+//
+// QOI files written in stripes by koi_image_write.h (see
+// koi_set_qoi_stripe_rows_on_write there) carry a table of where each stripe
+// starts, and each stripe decodes on its own. Give koi a way to run work in
+// parallel and such files are decoded one stripe per job:
+//
+//   koi_set_dispatch(func, context);
+//
+// 'func' must run job(arg, i) for every i from 0 to count-1, on whatever
+// threads it likes, and return only once they are all done; koi never
+// creates threads itself. This applies when the whole file is in memory
+// (koi_load_from_memory and friends). Files without a table, or loaded
+// through callbacks, are decoded as a single stream as before.
+//
+// To decode a lot of images in a tight loop, create a koi_decoder once and
+// reuse it:
+//
+//   koi_decoder *d = koi_decoder_create();
+//   koi_decoder_set_flip_vertically(d, 1);
+//   for (...) {
+//      koi_uc *pixels = koi_decoder_load_from_memory(d, buffer, len, &x, &y, &n, 4);
+//      // ... pixels stay valid until the next load with 'd' ...
+//   }
+//   koi_decoder_free(d);
+//
+// The decoder keeps its own options, ignoring koi_set_flip_vertically_on_load,
+// its own I/O buffer (KOI_IO_BUFFER_SIZE, off the stack) and a result buffer
+// that only grows. There are _into versions too, like koi_load_into.
+//
+// Indexing large libraries of assets usually only needs their sizes:
+//
+//   koi_info_result *results = malloc(n * sizeof(*results));
+//   ok = koi_info_batch(filenames, n, results);
+//
+// reads just the 14-byte header of every file, with a single unbuffered read
+// (read() on the file descriptor with KOI_USE_MMAP on POSIX), and checks files
+// in parallel when a dispatch function is set (see below). For a header that
+// is already in memory, koi_info_from_memory_fast parses it without any
+// setup; unlike koi_info_from_memory it doesn't check that the rest of the
+// file is there.
+//
+// Loading thousands of small images (icons, glyphs, sprites) one call at a
+// time spends a good part of the time on per-call overhead and allocations.
+// They can be decoded in one go instead:
+//
+//   koi_batch_result *results = malloc(n * sizeof(*results));
+//   koi_uc *block = koi_load_batch(items, n, results, 4);
+//   // ... results[i].data, .x, .y, .channels_in_file for every items[i] ...
+//   koi_image_free(block);
+//
+// Each koi_batch_item is a buffer and its length. The images are decoded
+// into one block, allocated once up front, which koi_load_batch returns
+// (NULL if nothing could be decoded). Every result says where its image
+// went, or why it failed, so one corrupt file doesn't stop the rest. With a
+// dispatch function set (see below), the batch is split into small groups
+// of images that are decoded in parallel; since groups are much smaller than
+// the batch, a pool that hands jobs to whichever thread is idle keeps every
+// core busy even when image sizes vary a lot.
+//
+// For map tiles and very large scans, a rectangle can be decoded on its own:
+//
+//   koi_uc *tile = koi_load_region_from_memory(buffer, len, x0, y0, 256, 256, &x, &y, &n, 4);
+//
+// returns only the 256x256 pixels at (x0,y0), with x and y set to the size
+// of the whole image. It needs memory for the region plus one image row, and
+// stops reading after the region's last row. The rows above it still have to
+// be decoded unless the file is striped (see koi_image_write.h) and in
+// memory, in which case decoding starts at the stripe holding row y0. With
+// koi_set_flip_vertically_on_load, (x0,y0) and the rows returned are those of
+// the flipped image, so y0 counts up from the bottom of the file.
+//
 // Note that koi_image pervasively uses ints in its public API for sizes,
 // including sizes of memory buffers. This is now part of the API and thus
 // hard to change without causing breakage. As a result, the various image
@@ -160,12 +312,23 @@ RECENT REVISION HISTORY:
 //
 // I/O callbacks allow you to read from arbitrary sources, like packaged
 // files or some other source. Data read from callbacks are processed
-// through a small internal buffer (currently 128 bytes) to try to reduce
-// overhead.
+// through an internal buffer of KOI_IO_BUFFER_SIZE bytes (32 KB unless you
+// #define it yourself, at least 128) to try to reduce overhead. Files are
+// read through the same buffer.
 //
-// The three functions you must define are "read" (reads some bytes of data),
+// The functions you must define are "read" (reads some bytes of data),
 // "skip" (skips some bytes of data).
 //
+// If the data already sits in memory you own (network packets, a cache of
+// decompressed pages, ...), use koi_load_from_fetch or koi_load_into_from_fetch
+// with a koi_io_fetch_callbacks instead. Its "fetch" hands back a pointer to
+// your next chunk and its size, and koi_image decodes straight from there
+// without copying it into the internal buffer. The chunk must stay valid
+// until the next call to "fetch" or until the load returns, whichever comes
+// first, and the first chunk must contain at least the file header (22
+// bytes for QOI). Since you choose the chunk size, this is also how to pick
+// a different buffer size for a particular call.
+//
 // ===========================================================================
 //
 // ADDITIONAL CONFIGURATION
@@ -182,10 +345,88 @@ RECENT REVISION HISTORY:
 //
 //      KOI_ONLY_QOI
 //
+//  - QOI is decoded by one row loop per output layout and sample size, so
+//   there is no per-pixel test for them. Embedded builds that only ever ask
+//   for a few of them can keep just those loops by #defining one or more of
+//
+//      KOI_ONLY_GREY8    KOI_ONLY_GREY_ALPHA8    KOI_ONLY_RGB8    KOI_ONLY_RGBA8
+//      KOI_ONLY_GREY16   KOI_ONLY_GREY_ALPHA16   KOI_ONLY_RGB16   KOI_ONLY_RGBA16
+//
+//   where the layout is what comes out (req_comp, or the file's channels
+//   when req_comp is 0) and 8 or 16 the koi_load or koi_load_16 family.
+//   Loads asking for anything else, koi_loadf included, fail with
+//   "unsupported". koi_qoi_decoder has its own loop and isn't affected.
+//
 //  - You can suppress implementation of any koi_loadf function to reduce
 //   your code footprint by #defining KOI_NO_LINEAR before creating
 //   the implementation.
 //
+//  - You can #define KOI_IO_BUFFER_SIZE to change the size of the buffer
+//   used to read from callbacks and files (see I/O CALLBACKS). It lives in
+//   a context on the stack of every load call, so lower it if your threads
+//   have small stacks.
+//
+//  - Instead of replacing KOI_MALLOC/KOI_FREE for the whole program, you
+//   can point koi_image at an allocator at run time:
+//
+//      koi_allocator a = { my_alloc, my_realloc, my_free, my_arena };
+//      koi_set_allocator_thread(&a);
+//
+//   Everything koi_image allocates on that thread (results, conversion
+//   buffers, decoder state) then comes from 'a', which makes a per-thread
+//   bump arena that is reset every frame possible. Free results with
+//   koi_image_free while the same allocator is set. koi_set_allocator sets
+//   it for all threads that haven't set their own.
+//
+//  - #define KOI_USE_MMAP to have the functions that take a filename
+//   (koi_load, koi_load_16, koi_loadf, their _into versions and koi_info)
+//   map the file into memory (mmap, or MapViewOfFile on Windows) and decode
+//   it like koi_load_from_memory, instead of reading it through stdio. That
+//   replaces many small read calls with page faults the OS reads ahead for,
+//   and koi_info only touches the page with the header. It also lets
+//   striped files be decoded in parallel (see koi_set_dispatch). Files that
+//   can't be mapped are read through stdio as before. The koi_*_from_file
+//   functions always use stdio, since they have to leave the FILE positioned
+//   after the image.
+//
+//  - #define KOI_STATS, for the implementation and every file that uses it,
+//   to add koi_stats and koi_set_stats(_thread). Loads then add to the
+//   struct you point them at: how many of each QOI chunk they decoded, I/O
+//   callback calls and bytes, allocations, and time spent decoding versus
+//   converting and flipping afterwards. That shows whether assets compress
+//   poorly, whether KOI_IO_BUFFER_SIZE is too small for your callbacks, or
+//   whether conversion passes dominate. Times use KOI_STATS_CLOCK(), which
+//   returns seconds as a double and defaults to clock(); #define it to a
+//   wall clock of your own for decoding in parallel. Without KOI_STATS none
+//   of this is compiled in. A struct set with koi_set_stats is shared by all
+//   threads, so use koi_set_stats_thread if more than one loads at once.
+//
+//  - #define KOI_CACHE, for the implementation and every file that uses it,
+//   to add koi_cache, for programs that load the same assets over and over:
+//
+//      koi_cache *c = koi_cache_create(64 << 20);
+//      koi_uc const *pixels = koi_cache_load_from_memory(c, buffer, len, &x, &y, &n, 4);
+//      // ... any number of threads may use 'pixels' at once, but not change it ...
+//      koi_cache_release(c, pixels);
+//      koi_cache_free(c);
+//
+//   Images are looked up by a hash of the file's bytes together with
+//   desired_channels, 8-bit/16-bit/float and the flip (and, for floats,
+//   koi_ldr_to_hdr_*) setting, so loading bytes that are already cached is
+//   a hash and a reference count instead of a decode and an allocation.
+//   Every result needs its own koi_cache_release. The least recently used
+//   images are evicted once the cache holds more than its budget; ones still
+//   in use are freed by their last release, and an image larger than the
+//   budget isn't kept at all. The cache is split into KOI_CACHE_SHARDS (16
+//   by default) parts with a lock each (pthreads, or SRW locks on Windows),
+//   so loads on different threads seldom wait for each other and never for
+//   another thread's decode; #define KOI_CACHE_NO_THREADS to leave the locks
+//   out. The hash is fast but not cryptographic: inputs of the same length
+//   and hash share an image, so for files from untrusted sources #define
+//   KOI_CACHE_VERIFY, which keeps a copy of every input and compares it on
+//   each hit. The cache uses the allocator set when it is created (see
+//   koi_set_allocator), on whichever thread frees its memory.
+//
 //  - If you define KOI_MAX_DIMENSIONS, koi_image will reject images greater
 //   than that size (in either width or height) without further processing.
 //   This is to let programs in the wild set an upper bound to prevent
@@ -242,6 +483,12 @@ typedef struct
    void    (*skip)  (void *user, int n);                 // skip the next 'n' bytes, or 'unget' the last -n bytes if negative
 } koi_io_callbacks;
 
+// zero-copy reads from memory the caller owns, see I/O CALLBACKS
+typedef struct
+{
+   int     (*fetch) (void *user, char const **data);     // point '*data' at your next bytes and return how many, 0 at the end
+} koi_io_fetch_callbacks;
+
 ////////////////////////////////////
 //
 // 8-bits-per-channel interface
@@ -249,6 +496,7 @@ typedef struct
 
 KOIDEF koi_uc *koi_load_from_memory    (koi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
 KOIDEF koi_uc *koi_load_from_callbacks (koi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF koi_uc *koi_load_from_fetch     (koi_io_fetch_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
 #if !defined(KOI_NO_STDIO)
 KOIDEF koi_uc *koi_load                (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -256,6 +504,23 @@ KOIDEF koi_uc *koi_load_from_file      (FILE *f, int *x, int *y, int *channels_i
 // for koi_load_from_file, file pointer is left pointing immediately after image
 #endif
 
+////////////////////////////////////
+//
+// region interface
+//
+// decode just the w*h rectangle at (x0,y0), 8 bits per channel; x and y are
+// the size of the whole image. decoding stops after the last row of the
+// region, and striped files are entered at the stripe holding its first row.
+// when flipping on load, y0 is a row of the flipped (bottom-up) image
+//
+
+KOIDEF koi_uc *koi_load_region_from_memory    (koi_uc const *buffer, int len, int x0, int y0, int w, int h, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF koi_uc *koi_load_region_from_callbacks (koi_io_callbacks const *clbk, void *user, int x0, int y0, int w, int h, int *x, int *y, int *channels_in_file, int desired_channels);
+
+#if !defined(KOI_NO_STDIO)
+KOIDEF koi_uc *koi_load_region                (char const *filename, int x0, int y0, int w, int h, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
 #if defined(KOI_WINDOWS_UTF8)
 KOIDEF int koi_convert_wchar_to_utf8   (char *buffer, size_t bufferlen, const wchar_t *input);
 #endif
@@ -268,7 +533,7 @@ KOIDEF int koi_convert_wchar_to_utf8   (char *buffer, size_t bufferlen, const wc
 KOIDEF koi_us *koi_load_16_from_memory    (koi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
 KOIDEF koi_us *koi_load_16_from_callbacks (koi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
-#if !defined(STBI_NO_STDIO)
+#if !defined(KOI_NO_STDIO)
 KOIDEF koi_us *koi_load_16                (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
 KOIDEF koi_us *koi_load_from_file_16      (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 #endif
@@ -290,6 +555,109 @@ KOIDEF koi_us *koi_load_from_file_16      (FILE *f, int *x, int *y, int *channel
    KOIDEF void   koi_ldr_to_hdr_scale(float scale);
 #endif // KOI_NO_LINEAR
 
+////////////////////////////////////
+//
+// caller-provided output interface
+//
+// same as above, but decode into 'dst' instead of allocating the result;
+// rows are 'stride_in_bytes' apart (0 = tightly packed) and the whole image
+// must fit in 'dst_capacity' bytes. returns 1 on success, 0 on failure
+//
+
+KOIDEF int koi_load_into_from_memory       (koi_uc const *buffer, int len, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int koi_load_into_from_callbacks    (koi_io_callbacks const *clbk, void *user, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int koi_load_into_from_fetch        (koi_io_fetch_callbacks const *clbk, void *user, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int koi_load_16_into_from_memory    (koi_uc const *buffer, int len, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int koi_load_16_into_from_callbacks (koi_io_callbacks const *clbk, void *user, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+
+#if !defined(KOI_NO_STDIO)
+KOIDEF int koi_load_into                   (char const *filename, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int koi_load_into_from_file         (FILE *f, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int koi_load_16_into                (char const *filename, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int koi_load_16_into_from_file      (FILE *f, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+#if !defined(KOI_NO_LINEAR)
+   KOIDEF int koi_loadf_into_from_memory    (koi_uc const *buffer, int len, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+   KOIDEF int koi_loadf_into_from_callbacks (koi_io_callbacks const *clbk, void *user, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+
+   #if !defined(KOI_NO_STDIO)
+   KOIDEF int koi_loadf_into                (char const *filename, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+   KOIDEF int koi_loadf_into_from_file      (FILE *f, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+   #endif
+#endif // KOI_NO_LINEAR
+
+////////////////////////////////////
+//
+// reusable decoder interface
+//
+// a decoder owns its I/O buffer, its options and a result buffer that is
+// reused from one image to the next, so decoding many images in a row
+// doesn't set any of that up again. a decoder is used by one thread at a time
+//
+
+typedef struct koi_decoder koi_decoder;
+
+KOIDEF koi_decoder *koi_decoder_create                (void);
+KOIDEF void         koi_decoder_free                  (koi_decoder *d);
+KOIDEF void         koi_decoder_set_flip_vertically   (koi_decoder *d, int flag_true_if_should_flip);
+// the result belongs to the decoder and stays valid until its next load or koi_decoder_free
+KOIDEF koi_uc      *koi_decoder_load_from_memory      (koi_decoder *d, koi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int          koi_decoder_load_into_from_memory (koi_decoder *d, koi_uc const *buffer, int len, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF int          koi_decoder_load_into_from_callbacks(koi_decoder *d, koi_io_callbacks const *clbk, void *user, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *channels_in_file, int desired_channels);
+
+////////////////////////////////////
+//
+// batch interface
+//
+// decode many images that are already in memory in one call, into a single
+// allocation; free it with koi_image_free once done with all of them
+//
+
+typedef struct
+{
+   koi_uc const *buffer;
+   int len;
+} koi_batch_item;
+
+typedef struct
+{
+   koi_uc *data;               // points into the returned block, NULL if this one failed
+   int x, y, channels_in_file; // 0 if the header couldn't be used
+   const char *failure_reason; // koi_failure_reason() for this image, if it failed
+} koi_batch_result;
+
+KOIDEF koi_uc *koi_load_batch(const koi_batch_item *items, int n, koi_batch_result *results, int desired_channels);
+
+#if !defined(KOI_NO_QOI)
+////////////////////////////////////
+//
+// incremental QOI interface
+//
+// decode a QOI stream from pieces as they arrive and take finished rows out
+// as they complete
+//
+
+typedef struct koi_qoi_decoder koi_qoi_decoder;
+
+KOIDEF koi_qoi_decoder *koi_qoi_decoder_init      (int desired_channels);
+KOIDEF int              koi_qoi_decoder_feed      (koi_qoi_decoder *d, koi_uc const *bytes, int len);
+KOIDEF koi_uc          *koi_qoi_decoder_buffer    (koi_qoi_decoder *d, int len);
+KOIDEF int              koi_qoi_decoder_commit    (koi_qoi_decoder *d, int len);
+KOIDEF int              koi_qoi_decoder_wanted    (koi_qoi_decoder *d);
+KOIDEF int              koi_qoi_decoder_info      (koi_qoi_decoder *d, int *x, int *y, int *channels_in_file);
+KOIDEF int              koi_qoi_decoder_next_rows (koi_qoi_decoder *d, koi_uc *dst, int stride_in_bytes, int max_rows);
+KOIDEF void             koi_qoi_decoder_free      (koi_qoi_decoder *d);
+
+// frame sequences written by koi_qoi_anim_begin in koi_image_write.h
+typedef struct koi_qoi_anim koi_qoi_anim;
+
+KOIDEF koi_qoi_anim    *koi_qoi_anim_open_memory  (koi_uc const *buffer, int len, int desired_channels);
+KOIDEF int              koi_qoi_anim_info         (koi_qoi_anim *a, int *x, int *y, int *channels_in_file, int *frames);
+KOIDEF koi_uc const    *koi_qoi_anim_frame        (koi_qoi_anim *a, int frame);
+KOIDEF void             koi_qoi_anim_close        (koi_qoi_anim *a);
+#endif // KOI_NO_QOI
+
 // get a VERY brief reason for failure
 // on most compilers (and ALL modern mainstream compilers) this is threadsafe
 KOIDEF const char *koi_failure_reason        (void);
@@ -297,6 +665,24 @@ KOIDEF const char *koi_failure_reason        (void);
 // free the loaded image -- this is just free()
 KOIDEF void        koi_image_free            (void *retval_from_koi_load);
 
+// where koi_image gets its memory from, the results as well as every
+// temporary buffer; 'realloc_fn' may be NULL. shared with koi_image_write.h
+#if !defined(KOI_ALLOCATOR_DEFINED)
+#define KOI_ALLOCATOR_DEFINED
+typedef struct
+{
+   void *(*alloc_fn)   (void *user, size_t size);
+   void *(*realloc_fn) (void *user, void *p, size_t old_size, size_t new_size);
+   void  (*free_fn)    (void *user, void *p);
+   void  *user;
+} koi_allocator;
+#endif
+
+// use 'a' (copied) for all loads, NULL to go back to KOI_MALLOC/KOI_FREE
+KOIDEF void        koi_set_allocator         (koi_allocator const *a);
+// as above, for loads on the calling thread only; needs thread-local variables
+KOIDEF void        koi_set_allocator_thread  (koi_allocator const *a);
+
 // get image dimensions & components without fully decoding
 KOIDEF int         koi_info_from_memory      (koi_uc const *buffer, int len, int *x, int *y, int *comp);
 KOIDEF int         koi_info_from_callbacks   (koi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
@@ -306,6 +692,23 @@ KOIDEF int         koi_info                  (char const *filename, int *x, int
 KOIDEF int         koi_info_from_file        (FILE *f, int *x, int *y, int *comp);
 #endif
 
+#if !defined(KOI_NO_QOI)
+// parses just the 14-byte QOI header at 'buffer', without setting anything
+// up; it doesn't look at (or need) the rest of the file
+KOIDEF int         koi_info_from_memory_fast (koi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+#if !defined(KOI_NO_STDIO)
+typedef struct
+{
+   int ok, x, y, channels_in_file;
+   const char *failure_reason; // koi_failure_reason() for this file, if !ok
+} koi_info_result;
+
+// koi_info for many files at once, reading only their headers; returns how many succeeded
+KOIDEF int         koi_info_batch            (char const *const *filenames, int n, koi_info_result *results);
+#endif
+#endif
+
 // flip the image vertically, so the first pixel in the output array is the bottom left
 KOIDEF void koi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
@@ -314,6 +717,56 @@ KOIDEF void koi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 // calling it will fail to link if your compiler doesn't
 KOIDEF void koi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// runs job(arg, i) for every i in [0, count), in parallel if it can, and returns
+// once all of them are done; koi uses it for work that splits into independent parts
+typedef void koi_dispatch_func(void *context, void (*job)(void *arg, int i), void *arg, int count);
+
+// hand parallel work to 'func' (NULL, the default, runs it on the calling thread)
+KOIDEF void koi_set_dispatch(koi_dispatch_func *func, void *context);
+KOIDEF void koi_set_dispatch_thread(koi_dispatch_func *func, void *context);
+
+#if defined(KOI_STATS)
+// what loads spent their work on, added up over every load until it is reset
+typedef struct
+{
+   // QOI chunks decoded of each kind. op_index over all of them is the index
+   // hit rate, run_pixels / op_run the average run length
+   unsigned long op_rgb, op_rgba, op_index, op_diff, op_luma, op_run;
+   unsigned long run_pixels;
+   // read/fetch callback calls, the ones that returned data, and their bytes
+   unsigned long io_calls, io_refills;
+   size_t io_bytes;
+   size_t allocations, bytes_allocated;
+   // seconds by KOI_STATS_CLOCK in the decoder, and after it in conversion
+   // and flip passes; postprocess_seconds is those two together
+   double decode_seconds, convert_seconds, flip_seconds, postprocess_seconds;
+} koi_stats;
+
+// add to '*stats' (not cleared) on every load from now on, NULL to stop
+KOIDEF void koi_set_stats(koi_stats *stats);
+KOIDEF void koi_set_stats_thread(koi_stats *stats);
+#endif
+
+#if defined(KOI_CACHE)
+// decoded images shared by every load of the same bytes, see ADDITIONAL CONFIGURATION
+typedef struct koi_cache koi_cache;
+
+// keeps images no longer in use until they take up more than 'byte_budget'
+KOIDEF koi_cache      *koi_cache_create               (size_t byte_budget);
+// every image from 'c' has to be released before this
+KOIDEF void            koi_cache_free                 (koi_cache *c);
+
+// like koi_load_from_memory and friends, but the result is shared and read-only
+KOIDEF koi_uc const   *koi_cache_load_from_memory     (koi_cache *c, koi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+KOIDEF koi_us const   *koi_cache_load_16_from_memory  (koi_cache *c, koi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+#if !defined(KOI_NO_LINEAR)
+KOIDEF float const    *koi_cache_loadf_from_memory    (koi_cache *c, koi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+// hand back a result of the above, instead of koi_image_free
+KOIDEF void            koi_cache_release              (koi_cache *c, void const *pixels);
+#endif
+
 #if defined(__cplusplus)
 }
 #endif
@@ -331,7 +784,15 @@ KOIDEF void koi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip)
    #endif
 #endif
 
+// KOI_ONLY_RGBA8 and friends keep just the row decoders for the output
+// layouts that are listed, see ADDITIONAL CONFIGURATION
+#if defined(KOI_ONLY_GREY8)  || defined(KOI_ONLY_GREY_ALPHA8)  || defined(KOI_ONLY_RGB8)  || defined(KOI_ONLY_RGBA8) || \
+    defined(KOI_ONLY_GREY16) || defined(KOI_ONLY_GREY_ALPHA16) || defined(KOI_ONLY_RGB16) || defined(KOI_ONLY_RGBA16)
+   #define KOI__QOI_ONLY_LAYOUTS
+#endif
+
 #include <string.h>
+#include <limits.h> // INT_MAX
 
 #if !defined(KOI_NO_LINEAR)
 #include <math.h>  // ldexp, pow
@@ -341,11 +802,40 @@ KOIDEF void koi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip)
 #include <stdio.h>
 #endif
 
+// the mmap path and the cache's locks
+#if defined(_WIN32) && ((defined(KOI_USE_MMAP) && !defined(KOI_NO_STDIO)) || (defined(KOI_CACHE) && !defined(KOI_CACHE_NO_THREADS)))
+   // all of it, so a later #include <windows.h> by the user still gets
+   // everything, but without the min/max macros that break std::min/max
+   #if !defined(NOMINMAX)
+      #define NOMINMAX
+      #include <windows.h>
+      #undef NOMINMAX
+   #else
+      #include <windows.h>
+   #endif
+#endif
+
+#if defined(KOI_USE_MMAP) && !defined(KOI_NO_STDIO) && !defined(_WIN32)
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
+
+#if defined(KOI_CACHE) && !defined(KOI_CACHE_NO_THREADS) && !defined(_WIN32)
+   #include <pthread.h>
+#endif
+
 #if !defined(KOI_ASSERT)
 #include <assert.h>
    #define KOI_ASSERT(x) assert(x)
 #endif
 
+#if defined(KOI_STATS) && !defined(KOI_STATS_CLOCK)
+#include <time.h>
+   #define KOI_STATS_CLOCK()  ((double)clock() / CLOCKS_PER_SEC)
+#endif
+
 #if defined(__cplusplus)
    #define KOI_EXTERN extern "C"
 #else
@@ -413,6 +903,13 @@ typedef unsigned char koi_validate_uint32[sizeof(koi__uint32) == 4 ? 1 : -1];
    #define KOI_FREE(p)        free(p)
 #endif
 
+#if !defined(KOI_IO_BUFFER_SIZE)
+   #define KOI_IO_BUFFER_SIZE (32 * 1024)
+#endif
+
+// koi__rewind relies on the first buffer holding everything 'test' looks at
+typedef unsigned char koi_validate_io_buffer_size[KOI_IO_BUFFER_SIZE >= 128 ? 1 : -1];
+
 #if !defined(KOI_MAX_DIMENSIONS)
    #define KOI_MAX_DIMENSIONS (1 << 24)
 #endif
@@ -429,40 +926,143 @@ typedef struct
    int img_n, img_out_n;
 
    koi_io_callbacks io;
+   int (*fetch)(void *user, char const **data); // replaces io.read when set
    void *io_user_data;
 
+   int from_memory;           // the whole stream is at img_buffer_original
    int read_from_callbacks;
    int buflen;
-   koi_uc buffer_start[128];
-   int callback_already_read;
+   koi_uc buffer_start[KOI_IO_BUFFER_SIZE];
 
    koi_uc *img_buffer, *img_buffer_end;
    koi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // caller-provided output buffer (koi_load_into_*), NULL to allocate one
+   void *out;
+   int out_stride, out_capacity;
+   int out_bits_per_channel;
+
+   int serial; // already running as a dispatched job, don't dispatch again
+   int flip;   // flip on load, -1 to take it from koi_set_flip_vertically_on_load*
+#if defined(KOI_STATS)
+   koi_stats *stats;
+#endif
 } koi__context;
 
+#if defined(KOI_STATS)
+static koi_stats *koi__stats_global;
+
+KOIDEF void koi_set_stats(koi_stats *stats)
+{
+   koi__stats_global = stats;
+}
+
+#if !defined(KOI_THREAD_LOCAL)
+   #define koi__stats_current  koi__stats_global
+#else
+static KOI_THREAD_LOCAL koi_stats *koi__stats_local;
+static KOI_THREAD_LOCAL int koi__stats_set;
+
+KOIDEF void koi_set_stats_thread(koi_stats *stats)
+{
+   koi__stats_local = stats;
+   koi__stats_set = 1;
+}
+
+#define koi__stats_current  (koi__stats_set ? koi__stats_local : koi__stats_global)
+#endif // KOI_THREAD_LOCAL
+
+static void koi__stats_merge(koi_stats *to, koi_stats const *from)
+{
+   to->op_rgb += from->op_rgb;
+   to->op_rgba += from->op_rgba;
+   to->op_index += from->op_index;
+   to->op_diff += from->op_diff;
+   to->op_luma += from->op_luma;
+   to->op_run += from->op_run;
+   to->run_pixels += from->run_pixels;
+   to->io_calls += from->io_calls;
+   to->io_refills += from->io_refills;
+   to->io_bytes += from->io_bytes;
+   to->allocations += from->allocations;
+   to->bytes_allocated += from->bytes_allocated;
+   to->decode_seconds += from->decode_seconds;
+   to->convert_seconds += from->convert_seconds;
+   to->flip_seconds += from->flip_seconds;
+   to->postprocess_seconds += from->postprocess_seconds;
+}
+
+// 'st' may be NULL. KOI__STATS_POST times one step after the decoder
+   #define KOI__STATS_ADD(st, field, n)  do { if (st) (st)->field += (n); } while (0)
+   #define KOI__STATS_TIME(st, field, stmt)                                            \
+      do {                                                                           \
+         double koi__t0 = KOI_STATS_CLOCK();                                         \
+         stmt;                                                                       \
+         KOI__STATS_ADD(st, field, KOI_STATS_CLOCK() - koi__t0);                     \
+      } while (0)
+   #define KOI__STATS_POST(st, field, stmt)                                            \
+      do {                                                                           \
+         double koi__t0 = KOI_STATS_CLOCK(), koi__dt;                                \
+         stmt;                                                                       \
+         koi__dt = KOI_STATS_CLOCK() - koi__t0;                                      \
+         KOI__STATS_ADD(st, field, koi__dt);                                         \
+         KOI__STATS_ADD(st, postprocess_seconds, koi__dt);                           \
+      } while (0)
+#else
+   #define KOI__STATS_ADD(st, field, n)      ((void)0)
+   #define KOI__STATS_TIME(st, field, stmt)  stmt
+   #define KOI__STATS_POST(st, field, stmt)  stmt
+#endif // KOI_STATS
+
 static void koi__refill_buffer(koi__context *s);
 
 // initialize a memory-decode context
 static void koi__start_mem(koi__context *s, koi_uc const *buffer, int len)
 {
    s->io.read = NULL;
+   s->fetch = NULL;
+   s->from_memory = 1;
    s->read_from_callbacks = 0;
-   s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (koi_uc*)buffer;
    s->img_buffer_end = s->img_buffer_original_end = (koi_uc*)buffer + len;
+   s->out = NULL;
+   s->serial = 0;
+   s->flip = -1;
+#if defined(KOI_STATS)
+   s->stats = koi__stats_current;
+#endif
 }
 
-// initialize a callback-based context
-static void koi__start_callbacks(koi__context *s, koi_io_callbacks *c, void *user)
+// initialize a callback-based context; with 'fetch' set, 'c' may be NULL
+static void koi__start_io(koi__context *s, koi_io_callbacks *c, int (*fetch)(void*, char const**), void *user)
 {
-   s->io = *c;
+#if defined(KOI_STATS)
+   s->stats = koi__stats_current;
+#endif
+   if (c)
+      s->io = *c;
+   s->fetch = fetch;
    s->io_user_data = user;
+   s->from_memory = 0;
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
-   s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    koi__refill_buffer(s);
+   s->img_buffer_original = s->img_buffer; // not our buffer if 'fetch' was used
    s->img_buffer_original_end = s->img_buffer_end;
+   s->out = NULL;
+   s->serial = 0;
+   s->flip = -1;
+}
+
+static void koi__start_callbacks(koi__context *s, koi_io_callbacks *c, void *user)
+{
+   koi__start_io(s, c, NULL, user);
+}
+
+static void koi__start_fetch(koi__context *s, koi_io_fetch_callbacks *c, void *user)
+{
+   koi__start_io(s, NULL, c->fetch, user);
 }
 
 #if !defined(KOI_NO_STDIO)
@@ -507,12 +1107,14 @@ typedef struct
 {
    int bits_per_channel;
    int num_channels;
+   int flipped; // the loader already wrote the rows bottom-up for flip-on-load
 } koi__result_info;
 
 #if !defined(KOI_NO_QOI)
 static int     koi__qoi_test(koi__context *s);
-static void   *koi__qoi_load(koi__context *s, int *x, int *y, int *comp, int req_comp, koi__result_info *ri);
+static void   *koi__qoi_load(koi__context *s, int *x, int *y, int *comp, int req_comp, koi__result_info *ri, int bpc);
 static int     koi__qoi_info(koi__context *s, int *x, int *y, int *comp);
+static koi_uc *koi__qoi_load_region(koi__context *s, int x0, int y0, int w, int h, int *x, int *y, int *comp, int req_comp);
 #endif
 
 static
@@ -534,9 +1136,80 @@ static int koi__err(const char *str)
 }
 #endif
 
+static koi_allocator koi__allocator_global;
+static int koi__allocator_global_set;
+
+KOIDEF void koi_set_allocator(koi_allocator const *a)
+{
+   koi__allocator_global_set = (a != NULL);
+   if (a) koi__allocator_global = *a;
+}
+
+#if defined(KOI_THREAD_LOCAL)
+static KOI_THREAD_LOCAL koi_allocator koi__allocator_local;
+static KOI_THREAD_LOCAL int koi__allocator_local_set, koi__allocator_set;
+
+KOIDEF void koi_set_allocator_thread(koi_allocator const *a)
+{
+   koi__allocator_local_set = (a != NULL);
+   koi__allocator_set = 1;
+   if (a) koi__allocator_local = *a;
+}
+#endif
+
+// the allocator loads on this thread use, NULL for KOI_MALLOC/KOI_FREE
+static koi_allocator const *koi__allocator(void)
+{
+#if defined(KOI_THREAD_LOCAL)
+   if (koi__allocator_set)
+      return koi__allocator_local_set ? &koi__allocator_local : NULL;
+#endif
+   return koi__allocator_global_set ? &koi__allocator_global : NULL;
+}
+
 static void *koi__malloc(size_t size)
 {
-   return KOI_MALLOC(size);
+   koi_allocator const *a = koi__allocator();
+#if defined(KOI_STATS)
+   koi_stats *st = koi__stats_current;
+   KOI__STATS_ADD(st, allocations, 1);
+   KOI__STATS_ADD(st, bytes_allocated, size);
+#endif
+   return a ? a->alloc_fn(a->user, size) : KOI_MALLOC(size);
+}
+
+static void koi__free(void *p)
+{
+   koi_allocator const *a = koi__allocator();
+   if (p == NULL)
+      return;
+   if (a)
+      a->free_fn(a->user, p);
+   else
+      KOI_FREE(p);
+}
+
+// keeps the first min(old_size, new_size) bytes; on failure 'p' is left alone
+static void *koi__realloc_sized(void *p, size_t old_size, size_t new_size)
+{
+   koi_allocator const *a = koi__allocator();
+   void *q;
+   if (a && a->realloc_fn && p) {
+#if defined(KOI_STATS)
+      koi_stats *st = koi__stats_current;
+      KOI__STATS_ADD(st, allocations, 1);
+      KOI__STATS_ADD(st, bytes_allocated, new_size);
+#endif
+      return a->realloc_fn(a->user, p, old_size, new_size);
+   }
+   q = koi__malloc(new_size);
+   if (q == NULL)
+      return NULL;
+   if (p) {
+      memcpy(q, p, old_size < new_size ? old_size : new_size);
+      koi__free(p);
+   }
+   return q;
 }
 
 // koi_image uses ints pervasively, including for offset calculations.
@@ -579,27 +1252,17 @@ static int koi__mad3sizes_valid(int a, int b, int c, int add)
 }
 
 // returns 1 if "a*b*c*d + add" has no negative terms/factors and doesn't overflow
-#if !defined(KOI_NO_LINEAR)
 static int koi__mad4sizes_valid(int a, int b, int c, int d, int add)
 {
    return koi__mul2sizes_valid(a, b) && koi__mul2sizes_valid(a * b, c) &&
       koi__mul2sizes_valid(a * b * c, d) && koi__addsizes_valid(a * b * c * d, add);
 }
-#endif
-
-static void *koi__malloc_mad3(int a, int b, int c, int add)
-{
-   if (!koi__mad3sizes_valid(a, b, c, add)) return NULL;
-   return koi__malloc((size_t)a * b * c + add);
-}
 
-#if !defined(KOI_NO_LINEAR)
 static void *koi__malloc_mad4(int a, int b, int c, int d, int add)
 {
    if (!koi__mad4sizes_valid(a, b, c, d, add)) return NULL;
    return koi__malloc((size_t)a * b * c * d + add);
 }
-#endif
 
 // koi__err - error
 // koi__errpf - error returning pointer to float
@@ -618,11 +1281,14 @@ static void *koi__malloc_mad4(int a, int b, int c, int d, int add)
 
 KOIDEF void koi_image_free(void *retval_from_koi_load)
 {
-   KOI_FREE(retval_from_koi_load);
+   koi__free(retval_from_koi_load);
 }
 
 #if !defined(KOI_NO_LINEAR)
 static float *koi__ldr_to_hdr(koi_uc *data, int x, int y, int comp);
+static void   koi__ldr_to_hdr_in_place(void *image, int x, int y, int comp, int stride);
+static float *koi__loadf_main(koi__context *s, int *x, int *y, int *comp, int req_comp);
+static void   koi__l2h_prepare(void);
 #endif
 
 static int koi__vertically_flip_on_load_global = 0;
@@ -648,14 +1314,54 @@ KOIDEF void koi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip)
                          : koi__vertically_flip_on_load_global)
 #endif // KOI_THREAD_LOCAL
 
-static void *koi__load_main(koi__context *s, int *x, int *y, int *comp, int req_comp, koi__result_info *ri)
+typedef struct
+{
+   koi_dispatch_func *func;
+   void *context;
+} koi__dispatch;
+
+static koi__dispatch koi__dispatch_global = { NULL, NULL };
+
+KOIDEF void koi_set_dispatch(koi_dispatch_func *func, void *context)
+{
+   koi__dispatch_global.func = func;
+   koi__dispatch_global.context = context;
+}
+
+#if !defined(KOI_THREAD_LOCAL)
+   #define koi__dispatch_current  koi__dispatch_global
+#else
+static KOI_THREAD_LOCAL koi__dispatch koi__dispatch_local;
+static KOI_THREAD_LOCAL int koi__dispatch_set;
+
+KOIDEF void koi_set_dispatch_thread(koi_dispatch_func *func, void *context)
+{
+   koi__dispatch_local.func = func;
+   koi__dispatch_local.context = context;
+   koi__dispatch_set = 1;
+}
+
+#define koi__dispatch_current  (koi__dispatch_set ? koi__dispatch_local : koi__dispatch_global)
+#endif // KOI_THREAD_LOCAL
+
+// 'bpc' is the sample size the caller would like, 8 or 16; loaders that can
+// produce it directly do so and report it in ri->bits_per_channel
+static void *koi__load_main(koi__context *s, int *x, int *y, int *comp, int req_comp, koi__result_info *ri, int bpc)
 {
+   // look the setting up once, everything after this goes by s->flip
+   if (s->flip < 0)
+      s->flip = koi__vertically_flip_on_load;
+
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
    ri->num_channels = 0;
 
    #if !defined(KOI_NO_QOI)
-   if (koi__qoi_test(s)) return koi__qoi_load(s, x, y, comp, req_comp, ri);
+   if (koi__qoi_test(s)) {
+      void *result;
+      KOI__STATS_TIME(s->stats, decode_seconds, result = koi__qoi_load(s, x, y, comp, req_comp, ri, bpc));
+      return result;
+   }
    #endif
 
    return koi__errpuc("unknown image type", "Image not of any known type, or corrupt");
@@ -669,7 +1375,7 @@ static koi__uint16 *koi__convert_8_to_16(koi_uc *orig, int w, int h, int channel
 
    enlarged = (koi__uint16*)koi__malloc_mad4(w, h, channels, 2, 0);
    if (enlarged == NULL) {
-       KOI_FREE(orig);
+       koi__free(orig);
        return (koi__uint16*)koi__errpuc("outofmem", "Out of memory");
    }
 
@@ -677,20 +1383,58 @@ static koi__uint16 *koi__convert_8_to_16(koi_uc *orig, int w, int h, int channel
    for (i = 0; i < img_len; ++i)
      enlarged[i] = (koi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   KOI_FREE(orig);
+   koi__free(orig);
    return enlarged;
 }
 
-static void koi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
+// widen 8-bit rows 'stride' bytes apart to 16 bits in place. each row is
+// converted back to front, so no sample is overwritten before it is read
+static void koi__convert_8_to_16_in_place(void *image, int w, int h, int channels, int stride)
+{
+   int i, j;
+   int row_len = w * channels;
+
+   for (j = 0; j < h; ++j) {
+      koi_uc *orig = (koi_uc*)image + (size_t)j * stride;
+      koi__uint16 *enlarged = (koi__uint16*)orig;
+      for (i = row_len - 1; i >= 0; --i)
+         enlarged[i] = (koi__uint16)((orig[i] << 8) + orig[i]);
+   }
+}
+
+// check that a w*h image with 'channels' components of s->out_bits_per_channel
+// bits fits into the caller-provided buffer, and resolve s->out_stride
+static int koi__out_fits(koi__context *s, int w, int h, int channels)
+{
+   int sample_bytes = s->out_bits_per_channel / 8;
+   int row_bytes;
+
+   if (!koi__mad3sizes_valid(w, channels, sample_bytes, 0))
+      return koi__err("too large", "Image too large to decode");
+   row_bytes = w * channels * sample_bytes;
+
+   if (s->out_stride == 0)
+      s->out_stride = row_bytes;
+   if (s->out_stride < row_bytes || s->out_stride % sample_bytes != 0)
+      return koi__err("bad stride", "Row stride too small or misaligned");
+
+   if (h > 0 && (s->out_capacity < row_bytes || (h - 1) > (s->out_capacity - row_bytes) / s->out_stride))
+      return koi__err("buffer too small", "Output buffer too small for image");
+   return 1;
+}
+
+// 'stride' is the distance between rows in bytes, 0 if they are tightly packed
+static void koi__vertical_flip(void *image, int w, int h, int bytes_per_pixel, int stride)
 {
    int row;
    size_t bytes_per_row = (size_t)w * bytes_per_pixel;
+   size_t row_stride = stride ? (size_t)stride : bytes_per_row;
    koi_uc temp[2048];
    koi_uc *bytes = (koi_uc*)image;
 
    for (row = 0; row < (h >> 1); row++) {
-      koi_uc *row0 = bytes + row * bytes_per_row;
-      koi_uc *row1 = bytes + (size_t)(h - row - 1) * bytes_per_row;
+      koi_uc *row0 = bytes + row * row_stride;
+      koi_uc *row1 = bytes + (size_t)(h - row - 1) * row_stride;
       // swap row0 with row1
       size_t bytes_left = bytes_per_row;
       while (bytes_left) {
@@ -708,7 +1452,7 @@ static void koi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
 static unsigned char *koi__load_and_postprocess_8bit(koi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    koi__result_info ri;
-   void *result = koi__load_main(s, x, y, comp, req_comp, &ri);
+   void *result = koi__load_main(s, x, y, comp, req_comp, &ri, 8);
 
    if (result == NULL)
       return NULL;
@@ -716,9 +1460,9 @@ static unsigned char *koi__load_and_postprocess_8bit(koi__context *s, int *x, in
    // it is the responsibility of the loaders to make sure we get 8 bit.
    KOI_ASSERT(ri.bits_per_channel == 8);
 
-   if (koi__vertically_flip_on_load) {
+   if (s->flip && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
-      koi__vertical_flip(result, *x, *y, channels * sizeof(koi_uc));
+      KOI__STATS_POST(s->stats, flip_seconds, koi__vertical_flip(result, *x, *y, channels * sizeof(koi_uc), s->out ? s->out_stride : 0));
    }
 
    return (unsigned char*)result;
@@ -727,7 +1471,7 @@ static unsigned char *koi__load_and_postprocess_8bit(koi__context *s, int *x, in
 static koi__uint16 *koi__load_and_postprocess_16bit(koi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    koi__result_info ri;
-   void *result = koi__load_main(s, x, y, comp, req_comp, &ri);
+   void *result = koi__load_main(s, x, y, comp, req_comp, &ri, 16);
 
    if (result == NULL)
       return NULL;
@@ -736,28 +1480,23 @@ static koi__uint16 *koi__load_and_postprocess_16bit(koi__context *s, int *x, int
    KOI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
    if (ri.bits_per_channel != 16) {
-      result = koi__convert_8_to_16((koi_uc*)result, *x, *y, req_comp == 0 ? *comp : req_comp);
+      if (s->out)
+         KOI__STATS_POST(s->stats, convert_seconds, koi__convert_8_to_16_in_place(result, *x, *y, req_comp == 0 ? *comp : req_comp, s->out_stride));
+      else
+         KOI__STATS_POST(s->stats, convert_seconds, result = koi__convert_8_to_16((koi_uc*)result, *x, *y, req_comp == 0 ? *comp : req_comp));
+      if (result == NULL)
+         return NULL;
       ri.bits_per_channel = 16;
    }
 
-   if (koi__vertically_flip_on_load) {
+   if (s->flip && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
-      koi__vertical_flip(result, *x, *y, channels * sizeof(koi__uint16));
+      KOI__STATS_POST(s->stats, flip_seconds, koi__vertical_flip(result, *x, *y, channels * sizeof(koi__uint16), s->out ? s->out_stride : 0));
    }
 
    return (koi__uint16*)result;
 }
 
-#if defined(KOI_NO_LINEAR)
-static void koi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
-{
-   if (koi__vertically_flip_on_load && result != NULL) {
-      int channels = req_comp ? req_comp : *comp;
-      koi__vertical_flip(result, *x, *y, channels * sizeof(float));
-   }
-}
-#endif
-
 #if !defined(KOI_NO_STDIO)
 
 #if defined(_WIN32) && defined(KOI_WINDOWS_UTF8)
@@ -799,23 +1538,109 @@ static FILE *koi__fopen(char const *filename, char const *mode)
    return f;
 }
 
-KOIDEF koi_uc *koi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+#if defined(KOI_USE_MMAP)
+// a read-only view of a whole file, so loading by filename can take the
+// memory path: no copies into the I/O buffer and no read calls, just page
+// faults the kernel can read ahead for. if the file can't be mapped (a pipe,
+// an empty file, one too big for an int) the load goes through stdio instead
+typedef struct
 {
-   FILE *f = koi__fopen(filename, "rb");
-   unsigned char *result;
-   if (f == NULL) return koi__errpuc("can't fopen", "Unable to open file");
-   result = koi_load_from_file(f, x, y, comp, req_comp);
-   fclose(f);
-   return result;
-}
+   koi_uc const *data;
+   int len;
+#if defined(_WIN32)
+   HANDLE file, mapping;
+#endif
+} koi__mapped_file;
 
-KOIDEF koi_uc *koi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+static int koi__map_file(koi__mapped_file *m, char const *filename)
 {
-   unsigned char *result;
-   koi__context s;
-   koi__start_file(&s, f);
-   result = koi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
-   if (result) {
+#if defined(_WIN32)
+   LARGE_INTEGER size;
+   #if defined(KOI_WINDOWS_UTF8)
+   wchar_t wFilename[4096];
+   if (0 == MultiByteToWideChar(65001 /* UTF8 */, 0, filename, -1, wFilename, (int)(sizeof(wFilename) / sizeof(*wFilename))))
+      return 0;
+   m->file = CreateFileW(wFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   #else
+   m->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   #endif
+   if (m->file == INVALID_HANDLE_VALUE)
+      return 0;
+   if (!GetFileSizeEx(m->file, &size) || size.QuadPart <= 0 || size.QuadPart > INT_MAX) {
+      CloseHandle(m->file);
+      return 0;
+   }
+   m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (m->mapping == NULL) {
+      CloseHandle(m->file);
+      return 0;
+   }
+   m->data = (koi_uc const*)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+   if (m->data == NULL) {
+      CloseHandle(m->mapping);
+      CloseHandle(m->file);
+      return 0;
+   }
+   m->len = (int)size.QuadPart;
+   return 1;
+#else
+   struct stat st;
+   void *p;
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0)
+      return 0;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > INT_MAX) {
+      close(fd);
+      return 0;
+   }
+   p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd); // the mapping keeps the file
+   if (p == MAP_FAILED)
+      return 0;
+   m->data = (koi_uc const*)p;
+   m->len = (int)st.st_size;
+   return 1;
+#endif
+}
+
+static void koi__unmap_file(koi__mapped_file *m)
+{
+#if defined(_WIN32)
+   UnmapViewOfFile((void*)m->data);
+   CloseHandle(m->mapping);
+   CloseHandle(m->file);
+#else
+   munmap((void*)m->data, (size_t)m->len);
+#endif
+}
+#endif // KOI_USE_MMAP
+
+KOIDEF koi_uc *koi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   unsigned char *result;
+#if defined(KOI_USE_MMAP)
+   koi__mapped_file m;
+   if (koi__map_file(&m, filename)) {
+      result = koi_load_from_memory(m.data, m.len, x, y, comp, req_comp);
+      koi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = koi__fopen(filename, "rb");
+   if (f == NULL) return koi__errpuc("can't fopen", "Unable to open file");
+   result = koi_load_from_file(f, x, y, comp, req_comp);
+   fclose(f);
+   return result;
+}
+
+KOIDEF koi_uc *koi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *result;
+   koi__context s;
+   koi__start_file(&s, f);
+   result = koi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
+   if (result) {
       // need to 'unget' all the characters in the IO buffer
       fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
    }
@@ -837,8 +1662,17 @@ KOIDEF koi__uint16 *koi_load_from_file_16(FILE *f, int *x, int *y, int *comp, in
 
 KOIDEF koi_us *koi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = koi__fopen(filename, "rb");
+   FILE *f;
    koi__uint16 *result;
+#if defined(KOI_USE_MMAP)
+   koi__mapped_file m;
+   if (koi__map_file(&m, filename)) {
+      result = koi_load_16_from_memory(m.data, m.len, x, y, comp, req_comp);
+      koi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = koi__fopen(filename, "rb");
    if (f == NULL) return (koi_us*)koi__errpuc("can't fopen", "Unable to open file");
    result = koi_load_from_file_16(f, x, y, comp, req_comp);
    fclose(f);
@@ -875,14 +1709,211 @@ KOIDEF koi_uc *koi_load_from_callbacks(koi_io_callbacks const *clbk, void *user,
    return koi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
 }
 
+KOIDEF koi_uc *koi_load_from_fetch(koi_io_fetch_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_fetch(&s, (koi_io_fetch_callbacks*)clbk, user);
+   return koi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
+}
+
+static koi_uc *koi__load_region_main(koi__context *s, int x0, int y0, int w, int h, int *x, int *y, int *comp, int req_comp)
+{
+   if (s->flip < 0)
+      s->flip = koi__vertically_flip_on_load;
+
+   #if !defined(KOI_NO_QOI)
+   if (koi__qoi_test(s)) {
+      koi_uc *result;
+      KOI__STATS_TIME(s->stats, decode_seconds, result = koi__qoi_load_region(s, x0, y0, w, h, x, y, comp, req_comp));
+      return result;
+   }
+   #endif
+
+   KOI_NOTUSED(x0); KOI_NOTUSED(y0); KOI_NOTUSED(w); KOI_NOTUSED(h);
+   KOI_NOTUSED(x); KOI_NOTUSED(y); KOI_NOTUSED(comp); KOI_NOTUSED(req_comp);
+   return koi__errpuc("unknown image type", "Image not of any known type, or corrupt");
+}
+
+KOIDEF koi_uc *koi_load_region_from_memory(koi_uc const *buffer, int len, int x0, int y0, int w, int h, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_mem(&s, buffer, len);
+   return koi__load_region_main(&s, x0, y0, w, h, x, y, comp, req_comp);
+}
+
+KOIDEF koi_uc *koi_load_region_from_callbacks(koi_io_callbacks const *clbk, void *user, int x0, int y0, int w, int h, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_callbacks(&s, (koi_io_callbacks*)clbk, user);
+   return koi__load_region_main(&s, x0, y0, w, h, x, y, comp, req_comp);
+}
+
+#if !defined(KOI_NO_STDIO)
+KOIDEF koi_uc *koi_load_region(char const *filename, int x0, int y0, int w, int h, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   koi_uc *result;
+   koi__context s;
+#if defined(KOI_USE_MMAP)
+   koi__mapped_file m;
+   if (koi__map_file(&m, filename)) {
+      result = koi_load_region_from_memory(m.data, m.len, x0, y0, w, h, x, y, comp, req_comp);
+      koi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = koi__fopen(filename, "rb");
+   if (f == NULL) return koi__errpuc("can't fopen", "Unable to open file");
+   koi__start_file(&s, f);
+   result = koi__load_region_main(&s, x0, y0, w, h, x, y, comp, req_comp);
+   fclose(f);
+   return result;
+}
+#endif
+
+static int koi__load_into_main(koi__context *s, void *dst, int stride, int capacity, int bits_per_channel, int *x, int *y, int *comp, int req_comp)
+{
+   void *result;
+
+   s->out = dst;
+   s->out_stride = stride;
+   s->out_capacity = capacity;
+   s->out_bits_per_channel = bits_per_channel;
+
+   // the loader decodes straight into the caller's rows at any sample size
+   if (bits_per_channel == 16)
+      result = koi__load_and_postprocess_16bit(s, x, y, comp, req_comp);
+   #if !defined(KOI_NO_LINEAR)
+   else if (bits_per_channel == 32)
+      result = koi__loadf_main(s, x, y, comp, req_comp);
+   #endif
+   else
+      result = koi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (result == NULL)
+      return 0;
+   KOI_ASSERT(result == dst);
+   return 1;
+}
+
+KOIDEF int koi_load_into_from_memory(koi_uc const *buffer, int len, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_mem(&s, buffer, len);
+   return koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, 8, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_load_into_from_callbacks(koi_io_callbacks const *clbk, void *user, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_callbacks(&s, (koi_io_callbacks*)clbk, user);
+   return koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, 8, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_load_into_from_fetch(koi_io_fetch_callbacks const *clbk, void *user, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_fetch(&s, (koi_io_fetch_callbacks*)clbk, user);
+   return koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, 8, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_load_16_into_from_memory(koi_uc const *buffer, int len, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_mem(&s, buffer, len);
+   return koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, 16, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_load_16_into_from_callbacks(koi_io_callbacks const *clbk, void *user, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_callbacks(&s, (koi_io_callbacks*)clbk, user);
+   return koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, 16, x, y, comp, req_comp);
+}
+
+#if !defined(KOI_NO_STDIO)
+static int koi__load_into_file(FILE *f, void *dst, int stride_in_bytes, int dst_capacity, int bits_per_channel, int *x, int *y, int *comp, int req_comp)
+{
+   int result;
+   koi__context s;
+   koi__start_file(&s, f);
+   result = koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, bits_per_channel, x, y, comp, req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+static int koi__load_into_filename(char const *filename, void *dst, int stride_in_bytes, int dst_capacity, int bits_per_channel, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   int result;
+#if defined(KOI_USE_MMAP)
+   koi__mapped_file m;
+   if (koi__map_file(&m, filename)) {
+      koi__context s;
+      koi__start_mem(&s, m.data, m.len);
+      result = koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, bits_per_channel, x, y, comp, req_comp);
+      koi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = koi__fopen(filename, "rb");
+   if (f == NULL) return koi__err("can't fopen", "Unable to open file");
+   result = koi__load_into_file(f, dst, stride_in_bytes, dst_capacity, bits_per_channel, x, y, comp, req_comp);
+   fclose(f);
+   return result;
+}
+
+KOIDEF int koi_load_into(char const *filename, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   return koi__load_into_filename(filename, dst, stride_in_bytes, dst_capacity, 8, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_load_into_from_file(FILE *f, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   return koi__load_into_file(f, dst, stride_in_bytes, dst_capacity, 8, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_load_16_into(char const *filename, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   return koi__load_into_filename(filename, dst, stride_in_bytes, dst_capacity, 16, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_load_16_into_from_file(FILE *f, koi_us *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   return koi__load_into_file(f, dst, stride_in_bytes, dst_capacity, 16, x, y, comp, req_comp);
+}
+#endif // !KOI_NO_STDIO
+
 #if !defined(KOI_NO_LINEAR)
 static float *koi__loadf_main(koi__context *s, int *x, int *y, int *comp, int req_comp)
 {
-   unsigned char *data;
-   data = koi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
-   if (data)
-      return koi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-   return koi__errpf("unknown image type", "Image not of any known type, or corrupt");
+   koi__result_info ri;
+   void *result;
+   int channels;
+
+   koi__l2h_prepare();
+   result = koi__load_main(s, x, y, comp, req_comp, &ri, 32);
+   if (result == NULL)
+      return NULL; // keep the loader's reason
+   channels = req_comp ? req_comp : *comp;
+
+   // loaders that can't produce floats directly hand back 8 bits
+   if (ri.bits_per_channel != 32) {
+      KOI_ASSERT(ri.bits_per_channel == 8);
+      if (s->out)
+         KOI__STATS_POST(s->stats, convert_seconds, koi__ldr_to_hdr_in_place(result, *x, *y, channels, s->out_stride));
+      else
+         KOI__STATS_POST(s->stats, convert_seconds, result = koi__ldr_to_hdr((koi_uc*)result, *x, *y, channels));
+      if (result == NULL)
+         return NULL;
+   }
+
+   if (s->flip && !ri.flipped)
+      KOI__STATS_POST(s->stats, flip_seconds, koi__vertical_flip(result, *x, *y, channels * sizeof(float), s->out ? s->out_stride : 0));
+
+   return (float*)result;
 }
 
 KOIDEF float *koi_loadf_from_memory(koi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
@@ -903,7 +1934,16 @@ KOIDEF float *koi_loadf_from_callbacks(koi_io_callbacks const *clbk, void *user,
 KOIDEF float *koi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
    float *result;
-   FILE *f = koi__fopen(filename, "rb");
+   FILE *f;
+#if defined(KOI_USE_MMAP)
+   koi__mapped_file m;
+   if (koi__map_file(&m, filename)) {
+      result = koi_loadf_from_memory(m.data, m.len, x, y, comp, req_comp);
+      koi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = koi__fopen(filename, "rb");
    if (f == NULL) return koi__errpf("can't fopen", "Unable to open file");
    result = koi_loadf_from_file(f, x, y, comp, req_comp);
    fclose(f);
@@ -918,6 +1958,32 @@ KOIDEF float *koi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_co
 }
 #endif // !KOI_NO_STDIO
 
+KOIDEF int koi_loadf_into_from_memory(koi_uc const *buffer, int len, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_mem(&s, buffer, len);
+   return koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, 32, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_loadf_into_from_callbacks(koi_io_callbacks const *clbk, void *user, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__context s;
+   koi__start_callbacks(&s, (koi_io_callbacks*)clbk, user);
+   return koi__load_into_main(&s, dst, stride_in_bytes, dst_capacity, 32, x, y, comp, req_comp);
+}
+
+#if !defined(KOI_NO_STDIO)
+KOIDEF int koi_loadf_into(char const *filename, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   return koi__load_into_filename(filename, dst, stride_in_bytes, dst_capacity, 32, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_loadf_into_from_file(FILE *f, float *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   return koi__load_into_file(f, dst, stride_in_bytes, dst_capacity, 32, x, y, comp, req_comp);
+}
+#endif // !KOI_NO_STDIO
+
 #endif // !KOI_NO_LINEAR
 
 #if !defined(KOI_NO_LINEAR)
@@ -925,6 +1991,37 @@ static float koi__l2h_gamma = 2.2f, koi__l2h_scale = 1.0f;
 
 KOIDEF void   koi_ldr_to_hdr_gamma(float gamma) { koi__l2h_gamma = gamma; }
 KOIDEF void   koi_ldr_to_hdr_scale(float scale) { koi__l2h_scale = scale; }
+
+// there are only 256 possible 8-bit samples, so the float conversion is a
+// table lookup. the table is rebuilt whenever the gamma or scale it was made
+// for no longer match the current settings
+typedef struct
+{
+   int valid;
+   float gamma, scale;
+   float color[256]; // pow(v / 255, gamma) * scale
+   float alpha[256]; // v / 255, alpha is always linear
+} koi__l2h_lut;
+
+static
+#if defined(KOI_THREAD_LOCAL)
+KOI_THREAD_LOCAL
+#endif
+koi__l2h_lut koi__l2h_table;
+
+static void koi__l2h_prepare(void)
+{
+   int i;
+   if (koi__l2h_table.valid && koi__l2h_table.gamma == koi__l2h_gamma && koi__l2h_table.scale == koi__l2h_scale)
+      return;
+   for (i = 0; i < 256; ++i) {
+      koi__l2h_table.color[i] = (float)(pow(i / 255.0f, koi__l2h_gamma) * koi__l2h_scale);
+      koi__l2h_table.alpha[i] = i / 255.0f;
+   }
+   koi__l2h_table.gamma = koi__l2h_gamma;
+   koi__l2h_table.scale = koi__l2h_scale;
+   koi__l2h_table.valid = 1;
+}
 #endif
 
 //////////////////////////////////////////////////////////////////////////////
@@ -941,8 +2038,19 @@ enum
 
 static void koi__refill_buffer(koi__context *s)
 {
-   int n = (s->io.read)(s->io_user_data, (char*)s->buffer_start, s->buflen);
-   s->callback_already_read += (int)(s->img_buffer - s->img_buffer_original);
+   char const *data = NULL;
+   int n;
+
+   if (s->fetch) {
+      // zero-copy, decode straight from the callback's own memory
+      n = (s->fetch)(s->io_user_data, &data);
+      if (data == NULL || n < 0) n = 0;
+   }
+   else
+      n = (s->io.read)(s->io_user_data, (char*)s->buffer_start, s->buflen);
+   KOI__STATS_ADD(s->stats, io_calls, 1);
+   KOI__STATS_ADD(s->stats, io_refills, n > 0);
+   KOI__STATS_ADD(s->stats, io_bytes, n > 0 ? (size_t)n : 0);
    if (n == 0) {
       // at end of file, treat same as if from memory, but need to handle case
       // where s->img_buffer isn't pointing to safe memory, e.g. 0-byte file
@@ -951,6 +2059,10 @@ static void koi__refill_buffer(koi__context *s)
       s->img_buffer_end = s->buffer_start + 1;
       *s->img_buffer = 0;
    }
+   else if (data) {
+      s->img_buffer = (koi_uc*)data;
+      s->img_buffer_end = (koi_uc*)data + n;
+   }
    else {
       s->img_buffer = s->buffer_start;
       s->img_buffer_end = s->buffer_start + n;
@@ -976,7 +2088,7 @@ static int koi__get16be(koi__context *s)
 
 static koi__uint32 koi__get32be(koi__context *s)
 {
-   koi__uint32 z = koi__get16be(s) << 16;
+   koi__uint32 z = (koi__uint32)koi__get16be(s) << 16;
    z += (koi__uint32)koi__get16be(s);
    return z;
 }
@@ -986,51 +2098,6 @@ static koi_uc koi__compute_y(int r, int g, int b)
    return (koi_uc)(((r * 77) + (g * 150) + (29 * b)) >> 8);
 }
 
-static unsigned char *koi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
-{
-   int i, j;
-   unsigned char *good;
-
-   if (req_comp == img_n) return data;
-   KOI_ASSERT(req_comp >= 1 && req_comp <= 4);
-
-   good = (unsigned char*)koi__malloc_mad3(x, y, req_comp, 0);
-   if (good == NULL) {
-      KOI_FREE(data);
-      return koi__errpuc("outofmem", "Out of memory");
-   }
-
-   for (j = 0; j < (int)y; ++j) {
-      unsigned char *src = data + j * x * img_n;
-      unsigned char *dest = good + j * x * req_comp;
-
-#define KOI__COMBO(a, b)  ((a) * 8 + (b))
-#define KOI__CASE(a, b)   case KOI__COMBO(a, b): for(i = x - 1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (KOI__COMBO(img_n, req_comp)) {
-         KOI__CASE(1, 2) { dest[0] = src[0]; dest[1] = 255; } break;
-         KOI__CASE(1, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
-         KOI__CASE(1, 4) { dest[0] = dest[1] = dest[2] = src[0]; dest[3] = 255; } break;
-         KOI__CASE(2, 1) { dest[0] = src[0]; } break;
-         KOI__CASE(2, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
-         KOI__CASE(2, 4) { dest[0] = dest[1] = dest[2] = src[0]; dest[3] = src[1]; } break;
-         KOI__CASE(3, 4) { dest[0] = src[0]; dest[1] = src[1]; dest[2] = src[2]; dest[3] = 255; } break;
-         KOI__CASE(3, 1) { dest[0] = koi__compute_y(src[0], src[1], src[2]); } break;
-         KOI__CASE(3, 2) { dest[0] = koi__compute_y(src[0], src[1], src[2]); dest[1] = 255; } break;
-         KOI__CASE(4, 1) { dest[0] = koi__compute_y(src[0], src[1], src[2]); } break;
-         KOI__CASE(4, 2) { dest[0] = koi__compute_y(src[0], src[1], src[2]); dest[1] = src[3]; } break;
-         KOI__CASE(4, 3) { dest[0] = src[0]; dest[1] = src[1]; dest[2] = src[2]; } break;
-         default: KOI_ASSERT(0); KOI_FREE(data); KOI_FREE(good); return koi__errpuc("unsupported", "Unsupported format conversion");
-      }
-#undef KOI__CASE
-#undef KOI__COMBO
-   }
-
-   KOI_FREE(data);
-   return good;
-}
-
 #if !defined(KOI_NO_LINEAR)
 static float *koi__ldr_to_hdr(koi_uc *data, int x, int y, int comp)
 {
@@ -1039,25 +2106,45 @@ static float *koi__ldr_to_hdr(koi_uc *data, int x, int y, int comp)
    if (data == NULL) return NULL;
    output = (float*)koi__malloc_mad4(x, y, comp, sizeof(float), 0);
    if (output == NULL) {
-       KOI_FREE(data);
+       koi__free(data);
        return koi__errpf("outofmem", "Out of memory");
    }
+   koi__l2h_prepare();
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp - 1;
    for (i = 0; i < x * y; ++i) {
       for (k = 0; k < n; ++k) {
-         output[i * comp + k] = (float)(pow(data[i * comp + k] / 255.0f, koi__l2h_gamma) * koi__l2h_scale);
+         output[i * comp + k] = koi__l2h_table.color[data[i * comp + k]];
       }
    }
    if (n < comp) {
       for (i = 0; i < x * y; ++i) {
-         output[i * comp + n] = data[i * comp + n] / 255.0f;
+         output[i * comp + n] = koi__l2h_table.alpha[data[i * comp + n]];
       }
    }
 
-   KOI_FREE(data);
+   koi__free(data);
    return output;
 }
+
+// same as above for 8-bit rows 'stride' bytes apart, converted in place back to front
+static void koi__ldr_to_hdr_in_place(void *image, int x, int y, int comp, int stride)
+{
+   int i, j, k, n;
+   koi__l2h_prepare();
+   // compute number of non-alpha components
+   if (comp & 1) n = comp; else n = comp - 1;
+   for (j = 0; j < y; ++j) {
+      koi_uc *data = (koi_uc*)image + (size_t)j * stride;
+      float *output = (float*)data;
+      for (i = x - 1; i >= 0; --i) {
+         if (n < comp)
+            output[i * comp + n] = koi__l2h_table.alpha[data[i * comp + n]];
+         for (k = n - 1; k >= 0; --k)
+            output[i * comp + k] = koi__l2h_table.color[data[i * comp + k]];
+      }
+   }
+}
 #endif
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1112,112 +2199,903 @@ typedef struct {
    koi_uc r, g, b, a;
 } koi__qoi_pixel;
 
-static void *koi__qoi_load(koi__context *s, int *x, int *y, int *comp, int req_comp, koi__result_info *ri)
-{
-   koi_uc *out;
-   koi__qoi_pixel index[64], prev_px;
-   koi__uint32 i, pos, len;
-   koi_uc target;
-   koi__qoi_data info;
-   KOI_NOTUSED(ri);
-
-   if (koi__qoi_parse_header(s, &info) == NULL)
-      return NULL; // error code already set
+// Longest QOI chunk is QOI_OP_RGBA: 1 tag byte + 4 payload bytes. As long as
+// this many bytes are buffered, a whole chunk can be read without checking.
+#define KOI__QOI_MAX_OP 5
 
-   if (s->img_y > KOI_MAX_DIMENSIONS) return koi__errpuc("too large", "Very large image (corrupt?)");
-   if (s->img_x > KOI_MAX_DIMENSIONS) return koi__errpuc("too large", "Very large image (corrupt?)");
+#define KOI__QOI_COLOR_HASH(px) ((px).r * 3 + (px).g * 5 + (px).b * 7 + (px).a * 11)
 
-   s->img_n = info.ch_n;
+// declares the 'stats' that KOI__QOI_DECODE_OP counts chunks in
+#if defined(KOI_STATS)
+   #define KOI__QOI_STATS(st)  koi_stats *stats = (st);
+#else
+   #define KOI__QOI_STATS(st)
+#endif
 
-   if (req_comp && req_comp >= 3) // we can directly decode 3 or 4
-      target = req_comp;
-   else
-      target = s->img_n;         // if they want monochrome, we'll post-convert
+// decodes a single chunk into 'px', 'run' = number of pixels it produces;
+// 'get' is the expression used to fetch the next byte of the stream. with
+// KOI_STATS the chunk is counted in 'stats', see KOI__QOI_STATS
+#define KOI__QOI_DECODE_OP(get)                                  \
+   tag = get;                                                    \
+   run = 1;                                                      \
+   if (tag == 0xfe /*QOI_OP_RGB*/) {                             \
+      KOI__STATS_ADD(stats, op_rgb, 1);                          \
+      px.r = get;                                                \
+      px.g = get;                                                \
+      px.b = get;                                                \
+   }                                                             \
+   else if (tag == 0xff /*QOI_OP_RGBA*/) {                       \
+      KOI__STATS_ADD(stats, op_rgba, 1);                         \
+      px.r = get;                                                \
+      px.g = get;                                                \
+      px.b = get;                                                \
+      px.a = get;                                                \
+   }                                                             \
+   else {                                                        \
+      switch (tag & 0xc0) {                                      \
+         case 0x00: /*QOI_OP_INDEX*/                             \
+            KOI__STATS_ADD(stats, op_index, 1);                  \
+            px = index[tag];                                     \
+            break;                                               \
+         case 0x40: /*QOI_OP_DIFF*/                              \
+            KOI__STATS_ADD(stats, op_diff, 1);                   \
+            px.r += ((tag >> 4) & 0x03) - 2;                     \
+            px.g += ((tag >> 2) & 0x03) - 2;                     \
+            px.b += ( tag       & 0x03) - 2;                     \
+            break;                                               \
+         case 0x80: /*QOI_OP_LUMA*/                              \
+            KOI__STATS_ADD(stats, op_luma, 1);                   \
+            dg = (tag & 0x3f) - 32;                              \
+            d2 = get;                                            \
+            px.r += dg - 8 + ((d2 >> 4) & 0x0f);                 \
+            px.g += dg;                                          \
+            px.b += dg - 8 + ( d2       & 0x0f);                 \
+            break;                                               \
+         default: /*QOI_OP_RUN*/                                 \
+            run = (tag & 0x3f) + 1;                              \
+            KOI__STATS_ADD(stats, op_run, 1);                    \
+            KOI__STATS_ADD(stats, run_pixels, run);              \
+            break;                                               \
+      }                                                          \
+   }                                                             \
+   index[KOI__QOI_COLOR_HASH(px) & (64 - 1)] = px
+
+// turn 'px' into the components of each output layout, and store them;
+// 'W' converts an 8-bit color component to the output sample type, 'WA' does
+// the same for alpha
+#define KOI__QOI_PACK_1(o, px, W, WA)  (o)[0] = W(koi__compute_y((px).r, (px).g, (px).b))
+#define KOI__QOI_PACK_2(o, px, W, WA)  (o)[0] = W(koi__compute_y((px).r, (px).g, (px).b)), (o)[1] = WA((px).a)
+#define KOI__QOI_PACK_3(o, px, W, WA)  (o)[0] = W((px).r), (o)[1] = W((px).g), (o)[2] = W((px).b)
+#define KOI__QOI_PACK_4(o, px, W, WA)  (o)[0] = W((px).r), (o)[1] = W((px).g), (o)[2] = W((px).b), (o)[3] = WA((px).a)
+#define KOI__QOI_WIDEN_8(v)            (v)
+#define KOI__QOI_WIDEN_16(v)           ((koi__uint16)((v) * 257)) // replicate to high and low byte, maps 0->0, 255->0xffff
+#define KOI__QOI_WIDEN_F(v)            koi__l2h_table.color[v]    // needs koi__l2h_prepare() first
+#define KOI__QOI_WIDEN_FA(v)           koi__l2h_table.alpha[v]
+#define KOI__QOI_STORE_1(d, o)  (d)[0] = (o)[0]
+#define KOI__QOI_STORE_2(d, o)  (d)[0] = (o)[0], (d)[1] = (o)[1]
+#define KOI__QOI_STORE_3(d, o)  (d)[0] = (o)[0], (d)[1] = (o)[1], (d)[2] = (o)[2]
+#define KOI__QOI_STORE_4(d, o)  (d)[0] = (o)[0], (d)[1] = (o)[1], (d)[2] = (o)[2], (d)[3] = (o)[3]
+
+// koi__qoi_decode_row_N decodes the next row of 'w' pixels with N components
+// into 'row'; '*pending' carries the part of a run that didn't fit over to the
+// next row. there is one of these per output layout and sample size, so
+// converting to the requested number of channels and bits happens as the
+// pixels are emitted, without a per-pixel switch and without a second image
+// buffer
+#define KOI__QOI_DECODE_ROW(name, n, T, W, WA)                                   \
+static void name(koi__context *s, void *row, koi__uint32 w, koi__qoi_pixel *index, koi__qoi_pixel *prev, koi__uint32 *pending) \
+{                                                                                \
+   koi_uc *p, *p_end;                                                            \
+   T *dst = (T*)row, o[4];                                                       \
+   koi__qoi_pixel px = *prev;                                                    \
+   koi__uint32 run = *pending, left = w;                                         \
+   koi_uc tag, dg, d2;                                                           \
+   KOI__QOI_STATS(s->stats)                                                      \
+                                                                                 \
+   /* finish a run carried over from the previous row */                         \
+   KOI__QOI_PACK_##n(o, px, W, WA);                                               \
+   for (; run && left; --run, --left, dst += n)                                  \
+      KOI__QOI_STORE_##n(dst, o);                                                \
+                                                                                 \
+   while (left) {                                                                \
+      p = s->img_buffer;                                                         \
+      if (s->img_buffer_end - p >= KOI__QOI_MAX_OP) {                            \
+         /* fast path: walk the buffered bytes directly, one bounds check per */ \
+         /* op. covers all but the last few bytes of the stream or refill     */ \
+         p_end = s->img_buffer_end - KOI__QOI_MAX_OP;                            \
+         do {                                                                    \
+            KOI__QOI_DECODE_OP(*p++);                                            \
+            KOI__QOI_PACK_##n(o, px, W, WA);                                      \
+            if (run == 1) {                                                      \
+               KOI__QOI_STORE_##n(dst, o);                                       \
+               dst += n;                                                         \
+               run = 0;                                                          \
+               --left;                                                           \
+            }                                                                    \
+            else {                                                               \
+               for (; run && left; --run, --left, dst += n)                      \
+                  KOI__QOI_STORE_##n(dst, o);                                    \
+            }                                                                    \
+         } while (p <= p_end && left);                                           \
+         s->img_buffer = p;                                                      \
+      }                                                                          \
+      else {                                                                     \
+         /* guarded path near the end of the buffer, refills from callbacks */   \
+         KOI__QOI_DECODE_OP(koi__get8(s));                                       \
+         KOI__QOI_PACK_##n(o, px, W, WA);                                         \
+         for (; run && left; --run, --left, dst += n)                            \
+            KOI__QOI_STORE_##n(dst, o);                                          \
+      }                                                                          \
+   }                                                                             \
+                                                                                 \
+   *prev = px;                                                                   \
+   *pending = run;                                                               \
+}
 
-   // sanity-check size
-   out = (koi_uc*)koi__malloc_mad3(s->img_x, s->img_y, target, 0);
-   if (out == NULL) return koi__errpuc("outofmem", "Out of memory");
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_GREY8)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row_1, 1, koi_uc, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8)
+#else
+   #define koi__qoi_decode_row_1 NULL
+#endif
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_GREY_ALPHA8)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row_2, 2, koi_uc, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8)
+#else
+   #define koi__qoi_decode_row_2 NULL
+#endif
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_RGB8)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row_3, 3, koi_uc, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8)
+#else
+   #define koi__qoi_decode_row_3 NULL
+#endif
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_RGBA8)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row_4, 4, koi_uc, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8)
+#else
+   #define koi__qoi_decode_row_4 NULL
+#endif
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_GREY16)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row16_1, 1, koi__uint16, KOI__QOI_WIDEN_16, KOI__QOI_WIDEN_16)
+#else
+   #define koi__qoi_decode_row16_1 NULL
+#endif
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_GREY_ALPHA16)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row16_2, 2, koi__uint16, KOI__QOI_WIDEN_16, KOI__QOI_WIDEN_16)
+#else
+   #define koi__qoi_decode_row16_2 NULL
+#endif
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_RGB16)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row16_3, 3, koi__uint16, KOI__QOI_WIDEN_16, KOI__QOI_WIDEN_16)
+#else
+   #define koi__qoi_decode_row16_3 NULL
+#endif
+#if !defined(KOI__QOI_ONLY_LAYOUTS) || defined(KOI_ONLY_RGBA16)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_row16_4, 4, koi__uint16, KOI__QOI_WIDEN_16, KOI__QOI_WIDEN_16)
+#else
+   #define koi__qoi_decode_row16_4 NULL
+#endif
+#if !defined(KOI_NO_LINEAR) && !defined(KOI__QOI_ONLY_LAYOUTS)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_rowf_1, 1, float, KOI__QOI_WIDEN_F, KOI__QOI_WIDEN_FA)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_rowf_2, 2, float, KOI__QOI_WIDEN_F, KOI__QOI_WIDEN_FA)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_rowf_3, 3, float, KOI__QOI_WIDEN_F, KOI__QOI_WIDEN_FA)
+KOI__QOI_DECODE_ROW(koi__qoi_decode_rowf_4, 4, float, KOI__QOI_WIDEN_F, KOI__QOI_WIDEN_FA)
+#endif
 
-   prev_px.r = 0;
-   prev_px.g = 0;
-   prev_px.b = 0;
-   prev_px.a = 255;
+#undef KOI__QOI_DECODE_ROW
 
-   memset(index, 0, sizeof(index));
+typedef void koi__qoi_decode_row_func(koi__context *s, void *row, koi__uint32 w, koi__qoi_pixel *index, koi__qoi_pixel *prev, koi__uint32 *pending);
 
-#define KOI_QOI_COLOR_HASH(px) (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11)
+// indexed by [8, 16 or 32-bit output][components - 1]. the layouts left out
+// by KOI_ONLY_* are NULL, and the loads check for that before decoding
+static koi__qoi_decode_row_func *const koi__qoi_decode_row[3][4] =
+{
+   { koi__qoi_decode_row_1,   koi__qoi_decode_row_2,   koi__qoi_decode_row_3,   koi__qoi_decode_row_4   },
+   { koi__qoi_decode_row16_1, koi__qoi_decode_row16_2, koi__qoi_decode_row16_3, koi__qoi_decode_row16_4 },
+#if !defined(KOI_NO_LINEAR) && !defined(KOI__QOI_ONLY_LAYOUTS)
+   { koi__qoi_decode_rowf_1,  koi__qoi_decode_rowf_2,  koi__qoi_decode_rowf_3,  koi__qoi_decode_rowf_4  }
+#else
+   { NULL, NULL, NULL, NULL }
+#endif
+};
 
-   len = s->img_y * s->img_x;
-   for (i = 0; i < len; ++i) {
-      pos = i * target;
-      koi_uc tag = koi__get8(s);
+#if defined(KOI__QOI_ONLY_LAYOUTS)
+   #undef koi__qoi_decode_row_1
+   #undef koi__qoi_decode_row_2
+   #undef koi__qoi_decode_row_3
+   #undef koi__qoi_decode_row_4
+   #undef koi__qoi_decode_row16_1
+   #undef koi__qoi_decode_row16_2
+   #undef koi__qoi_decode_row16_3
+   #undef koi__qoi_decode_row16_4
+#endif
 
-      if (tag == 0xfe /*QOI_OP_RGB*/) {
-         prev_px.r = koi__get8(s);
-         prev_px.g = koi__get8(s);
-         prev_px.b = koi__get8(s);
-      }
-      else if (tag == 0xff /*QOI_OP_RGBA*/) {
-         prev_px.r = koi__get8(s);
-         prev_px.g = koi__get8(s);
-         prev_px.b = koi__get8(s);
-         prev_px.a = koi__get8(s);
-      }
-      else {
-         koi_uc t = tag & 0xc0;
-         if (t == 0x00 /*QOI_OP_INDEX*/) {
-            prev_px = index[tag];
-         }
-         else if (t == 0x40 /*QOI_OP_DIFF*/) {
-            koi_uc d = tag ^ 0x40;
-            prev_px.r += ((d >> 4) & 0x03) - 2;
-            prev_px.g += ((d >> 2) & 0x03) - 2;
-            prev_px.b += ( d       & 0x03) - 2;
-         }
-         else if (t == 0x80 /*QOI_OP_LUMA*/) {
-            koi_uc dg = (tag ^ 0x80) - 32;
-            koi_uc d2 = koi__get8(s);
-            prev_px.r += dg - 8 + ((d2 >> 4) & 0x0f);
-            prev_px.g += dg;
-            prev_px.b += dg - 8 + ( d2       & 0x0f);
-         }
-         else if (t == 0xc0 /*QOI_OP_RUN*/) {
-            koi_uc run = (tag ^ 0xc0) + 1;
-            index[KOI_QOI_COLOR_HASH(prev_px) & (64 - 1)] = prev_px;
-            while (run--) {
-               out[pos++] = prev_px.r;
-               out[pos++] = prev_px.g;
-               out[pos]   = prev_px.b;
-               if (target == 4) out[++pos] = prev_px.a;
-               if (run > 0) {
-                  ++i; ++pos;
-               }
-            }
-            continue;
-         }
+// a striped file, see koi_image_write.h, ends in a table of where each stripe
+// starts. every stripe decodes on its own from the initial state, so when the
+// whole stream is in memory the stripes are handed to the dispatch function
+typedef struct
+{
+   koi_uc const *data;
+   koi__uint32 *offset; // count + 1 entries, the last one is the end marker
+   int stripe_rows, flip, kind, target, stride;
+   koi__uint32 w, h;
+   koi_uc *out;
+#if !defined(KOI_NO_LINEAR)
+   koi__l2h_lut const *l2h;
+#endif
+#if defined(KOI_STATS)
+   koi_stats *stats;    // one per stripe, added up once they are all done
+#endif
+} koi__qoi_stripes;
+
+static koi__uint32 koi__qoi_be32(koi_uc const *p)
+{
+   return (koi__uint32)p[0] << 24 | (koi__uint32)p[1] << 16 | (koi__uint32)p[2] << 8 | p[3];
+}
+
+static void koi__qoi_decode_stripe(void *arg, int i)
+{
+   koi__qoi_stripes *t = (koi__qoi_stripes*)arg;
+   koi__qoi_decode_row_func *decode_row = koi__qoi_decode_row[t->kind][t->target - 1];
+   koi__qoi_pixel index[64], px;
+   koi__uint32 run = 0, j, j_end;
+   koi__context s;
+
+#if !defined(KOI_NO_LINEAR)
+   // the float table belongs to the thread that asked for the image
+   if (t->kind == 2 && t->l2h != &koi__l2h_table)
+      koi__l2h_table = *t->l2h;
+#endif
+
+   koi__start_mem(&s, t->data + t->offset[i], (int)(t->offset[i + 1] - t->offset[i]));
+#if defined(KOI_STATS)
+   s.stats = t->stats ? &t->stats[i] : NULL;
+#endif
+   px.r = 0;
+   px.g = 0;
+   px.b = 0;
+   px.a = 255;
+   memset(index, 0, sizeof(index));
+
+   j = (koi__uint32)i * t->stripe_rows;
+   j_end = (t->h - j < (koi__uint32)t->stripe_rows) ? t->h : j + t->stripe_rows;
+   for (; j < j_end; ++j)
+      decode_row(&s, t->out + (size_t)(t->flip ? t->h - 1 - j : j) * t->stride, t->w, index, &px, &run);
+}
+
+// where the stripe table starts, after checking that it describes this
+// image, or 0 if there's no usable table; needs the whole stream in memory
+static koi__uint32 koi__qoi_stripe_table(koi__context *s, koi__uint32 *rows_out, koi__uint32 *count_out)
+{
+   koi__uint32 count, rows, table, i, o, prev;
+   koi_uc const *end;
+   size_t len;
+
+   if (!s->from_memory)
+      return 0;
+   end = s->img_buffer_original_end;
+   len = (size_t)(end - s->img_buffer_original);
+   if (len < 14 + 8 + 16 || memcmp(end - 4, "kois", 4) != 0)
+      return 0;
+   rows = koi__qoi_be32(end - 12);
+   count = koi__qoi_be32(end - 8);
+   if (rows == 0 || rows > s->img_y || count < 2 || count != (s->img_y - 1) / rows + 1)
+      return 0;
+   if (count > (len - 14 - 8 - 12) / 4)
+      return 0;
+   table = (koi__uint32)(len - 12 - 4 * (size_t)count);
+   if (memcmp(s->img_buffer_original + table - 8, "\0\0\0\0\0\0\0\1", 8) != 0)
+      return 0;
+   for (prev = 14, i = 0; i < count; ++i) {
+      o = koi__qoi_be32(s->img_buffer_original + table + 4 * i);
+      if (o < prev || (i == 0 && o != 14) || o > table - 8)
+         return 0;
+      prev = o;
+   }
+
+   *rows_out = rows;
+   *count_out = count;
+   return table;
+}
+
+// 1 if the image was decoded from its stripes, 0 to decode it as one stream;
+// a table that doesn't make sense is ignored
+static int koi__qoi_load_stripes(koi__context *s, koi_uc *out, int stride, int kind, int target, int flip)
+{
+   koi__qoi_stripes t;
+   koi__dispatch dispatch = koi__dispatch_current;
+   koi__uint32 count, rows, table, i;
+
+   if (dispatch.func == NULL || s->serial)
+      return 0; // not worth it without threads
+   table = koi__qoi_stripe_table(s, &rows, &count);
+   if (table == 0)
+      return 0;
+
+   t.offset = (koi__uint32*)koi__malloc(sizeof(koi__uint32) * (count + 1));
+   if (t.offset == NULL)
+      return 0;
+   for (i = 0; i < count; ++i)
+      t.offset[i] = koi__qoi_be32(s->img_buffer_original + table + 4 * i);
+   t.offset[count] = table - 8;
+
+   t.data = s->img_buffer_original;
+   t.stripe_rows = (int)rows;
+   t.flip = flip;
+   t.kind = kind;
+   t.target = target;
+   t.stride = stride;
+   t.w = s->img_x;
+   t.h = s->img_y;
+   t.out = out;
+#if !defined(KOI_NO_LINEAR)
+   t.l2h = &koi__l2h_table;
+#endif
+#if defined(KOI_STATS)
+   t.stats = NULL;
+   if (s->stats) {
+      t.stats = (koi_stats*)koi__malloc(sizeof(koi_stats) * count);
+      if (t.stats == NULL) {
+         koi__free(t.offset);
+         return 0;
       }
-      
-      index[KOI_QOI_COLOR_HASH(prev_px) & (64 - 1)] = prev_px;
+      memset(t.stats, 0, sizeof(koi_stats) * count);
+   }
+#endif
+   dispatch.func(dispatch.context, koi__qoi_decode_stripe, &t, (int)count);
+#if defined(KOI_STATS)
+   if (t.stats) {
+      for (i = 0; i < count; ++i)
+         koi__stats_merge(s->stats, &t.stats[i]);
+      koi__free(t.stats);
+   }
+#endif
+   koi__free(t.offset);
+   return 1;
+}
 
-      out[pos++] = prev_px.r;
-      out[pos++] = prev_px.g;
-      out[pos]   = prev_px.b;
-      if(target == 4) out[++pos] = prev_px.a;
+static void *koi__qoi_load(koi__context *s, int *x, int *y, int *comp, int req_comp, koi__result_info *ri, int bpc)
+{
+   koi_uc *out;
+   koi__qoi_pixel index[64], px;
+   koi__qoi_decode_row_func *decode_row;
+   koi__uint32 run;
+   int target, sample_bytes, kind, stride, j, jstart, jdir;
+   koi__qoi_data info;
+
+   if (koi__qoi_parse_header(s, &info) == NULL)
+      return NULL; // error code already set
+
+   if (s->img_y > KOI_MAX_DIMENSIONS) return koi__errpuc("too large", "Very large image (corrupt?)");
+   if (s->img_x > KOI_MAX_DIMENSIONS) return koi__errpuc("too large", "Very large image (corrupt?)");
+
+   s->img_n = info.ch_n;
+
+   target = req_comp ? req_comp : s->img_n;
+   KOI_ASSERT(target >= 1 && target <= 4);
+
+   // samples are always 8 bits in the file, but widening them as they are
+   // emitted is cheaper than a second pass over the image. 32 means float,
+   // which the caller has set up the conversion table for
+   switch (bpc) {
+      case 16: kind = 1; sample_bytes = 2; break;
+      #if !defined(KOI_NO_LINEAR)
+      case 32: kind = 2; sample_bytes = 4; break;
+      #endif
+      default: kind = 0; sample_bytes = 1; break;
+   }
+   if (koi__qoi_decode_row[kind][target - 1] == NULL)
+      return koi__errpuc("unsupported", "Output layout left out by KOI_ONLY_*");
+
+   if (s->out) {
+      // decode straight into the caller's rows
+      if (!koi__out_fits(s, s->img_x, s->img_y, target))
+         return NULL;
+      out = (koi_uc*)s->out;
+      stride = s->out_stride;
+   }
+   else {
+      // sanity-check size
+      out = (koi_uc*)koi__malloc_mad4(s->img_x, s->img_y, target, sample_bytes, 0);
+      if (out == NULL) return koi__errpuc("outofmem", "Out of memory");
+      stride = s->img_x * target * sample_bytes;
    }
 
-#undef KOI_QOI_COLOR_HASH
-   
-   if (req_comp && req_comp != target) {
-      out = koi__convert_format(out, target, req_comp, s->img_x, s->img_y);
-      if (out == NULL) return out; // koi__convert_format frees input on failure
+   px.r = 0;
+   px.g = 0;
+   px.b = 0;
+   px.a = 255;
+
+   memset(index, 0, sizeof(index));
+
+   // with flip-on-load the rows are simply written bottom-up, so the
+   // postprocess doesn't have to swap them afterwards
+   if (s->flip) {
+      jstart = (int)s->img_y - 1;
+      jdir = -1;
+      ri->flipped = 1;
+   }
+   else {
+      jstart = 0;
+      jdir = 1;
+   }
+
+   if (!koi__qoi_load_stripes(s, out, stride, kind, target, jdir < 0)) {
+      decode_row = koi__qoi_decode_row[kind][target - 1];
+      run = 0;
+      for (j = 0; j < (int)s->img_y; ++j)
+         decode_row(s, out + (size_t)(jstart + j * jdir) * stride, s->img_x, index, &px, &run);
+      // a run still pending here is corrupt data past the end of the image, drop it
    }
 
    *x = s->img_x;
    *y = s->img_y;
    if (comp) *comp = s->img_n;
+   ri->bits_per_channel = sample_bytes * 8;
    return out;
 }
 
+// only rows y0 to y0+h-1 are decoded, and of those only the columns that are
+// asked for are kept. a striped file is entered at the stripe holding y0,
+// everything else from the top
+static koi_uc *koi__qoi_load_region(koi__context *s, int x0, int y0, int w, int h, int *x, int *y, int *comp, int req_comp)
+{
+   koi_uc *out, *row;
+   koi__qoi_pixel index[64], px;
+   koi__qoi_decode_row_func *decode_row;
+   koi__uint32 run, rows, count, table, j, j_end;
+   int target, row_bytes;
+   koi__qoi_data info;
+
+   if (koi__qoi_parse_header(s, &info) == NULL)
+      return NULL; // error code already set
+
+   if (s->img_y > KOI_MAX_DIMENSIONS) return koi__errpuc("too large", "Very large image (corrupt?)");
+   if (s->img_x > KOI_MAX_DIMENSIONS) return koi__errpuc("too large", "Very large image (corrupt?)");
+   if (x0 < 0 || y0 < 0 || w <= 0 || h <= 0 || (koi__uint32)x0 + w > s->img_x || (koi__uint32)y0 + h > s->img_y)
+      return koi__errpuc("bad region", "Region is not inside the image");
+   // flipped, (x0,y0) is in the bottom-up image the full load would return
+   if (s->flip)
+      y0 = (int)s->img_y - y0 - h;
+
+   s->img_n = info.ch_n;
+
+   target = req_comp ? req_comp : s->img_n;
+   KOI_ASSERT(target >= 1 && target <= 4);
+   if (koi__qoi_decode_row[0][target - 1] == NULL)
+      return koi__errpuc("unsupported", "Output layout left out by KOI_ONLY_*");
+
+   // unless whole rows are wanted, they are decoded into one spare row at
+   // the end of the result and the columns copied out of it
+   row_bytes = w * target;
+   out = (koi_uc*)koi__malloc_mad4(w, h, target, 1, w == (int)s->img_x ? 0 : (int)s->img_x * target);
+   if (out == NULL) return koi__errpuc("outofmem", "Out of memory");
+   row = out + (size_t)row_bytes * h;
+
+   px.r = 0;
+   px.g = 0;
+   px.b = 0;
+   px.a = 255;
+
+   memset(index, 0, sizeof(index));
+
+   j = 0;
+   table = koi__qoi_stripe_table(s, &rows, &count);
+   if (table != 0 && (koi__uint32)y0 >= rows) {
+      j = (koi__uint32)y0 / rows * rows;
+      s->img_buffer = s->img_buffer_original + koi__qoi_be32(s->img_buffer_original + table + 4 * (j / rows));
+   }
+
+   decode_row = koi__qoi_decode_row[0][target - 1];
+   run = 0;
+   for (j_end = (koi__uint32)y0 + h; j < j_end; ++j) {
+      koi_uc *dst;
+      if (j < (koi__uint32)y0) {
+         // rows above the region still have to go through the decoder
+         decode_row(s, w == (int)s->img_x ? out : row, s->img_x, index, &px, &run);
+         continue;
+      }
+      dst = out + (size_t)(s->flip ? j_end - 1 - j : j - y0) * row_bytes;
+      if (w == (int)s->img_x)
+         decode_row(s, dst, s->img_x, index, &px, &run);
+      else {
+         decode_row(s, row, s->img_x, index, &px, &run);
+         memcpy(dst, row + (size_t)x0 * target, row_bytes);
+      }
+   }
+
+   *x = s->img_x;
+   *y = s->img_y;
+   if (comp) *comp = s->img_n;
+   return out;
+}
+
+// incremental decoding. rather than blocking on callbacks, the decoder only
+// consumes whole chunks that have fully arrived and keeps everything else,
+// the 64-entry index, the previous pixel, a pending run and the row being
+// built, between calls
+struct koi_qoi_decoder
+{
+   int req_comp, target;
+   int have_header, failed;
+   koi__uint32 w, h;
+   int img_n, row_bytes;
+   koi__uint32 row, col; // rows handed out, pixels of the current row decoded
+   koi__uint32 run;      // pixels of the last chunk not emitted yet
+   koi__qoi_pixel px, index[64];
+   koi_uc *row_buf;
+   koi_uc *in;           // fed bytes not decoded yet start at in + in_pos
+   int in_pos, in_len, in_cap;
+   int in_room;          // bytes koi_qoi_decoder_buffer made room for
+};
+
+static void koi__qoi_pack(koi_uc *o, koi__qoi_pixel px, int n)
+{
+   switch (n) {
+      case 1: KOI__QOI_PACK_1(o, px, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8); break;
+      case 2: KOI__QOI_PACK_2(o, px, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8); break;
+      case 3: KOI__QOI_PACK_3(o, px, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8); break;
+      default: KOI__QOI_PACK_4(o, px, KOI__QOI_WIDEN_8, KOI__QOI_WIDEN_8); break;
+   }
+}
+
+// parse the header once its 14 bytes are there; 1 if it has been parsed
+static int koi__qoi_decoder_header(koi_qoi_decoder *d)
+{
+   koi__context s;
+   koi__qoi_data info;
+
+   if (d->have_header) return 1;
+   if (d->failed || d->in_len - d->in_pos < 14) return 0;
+
+   koi__start_mem(&s, d->in + d->in_pos, 14);
+   if (koi__qoi_parse_header(&s, &info) == NULL) {
+      d->failed = 1;
+      return 0; // error code already set
+   }
+   if (s.img_y > KOI_MAX_DIMENSIONS || s.img_x > KOI_MAX_DIMENSIONS) {
+      d->failed = 1;
+      return koi__err("too large", "Very large image (corrupt?)");
+   }
+
+   d->w = s.img_x;
+   d->h = s.img_y;
+   d->img_n = info.ch_n;
+   d->target = d->req_comp ? d->req_comp : d->img_n;
+   if (!koi__mad3sizes_valid((int)d->w, d->target, 1, 1)) {
+      d->failed = 1;
+      return koi__err("too large", "Image too large to decode");
+   }
+   d->row_bytes = (int)d->w * d->target;
+   d->row_buf = (koi_uc*)koi__malloc(d->row_bytes + 1);
+   if (d->row_buf == NULL) {
+      d->failed = 1;
+      return koi__err("outofmem", "Out of memory");
+   }
+   d->in_pos += 14;
+   d->have_header = 1;
+   return 1;
+}
+
+KOIDEF koi_qoi_decoder *koi_qoi_decoder_init(int desired_channels)
+{
+   koi_qoi_decoder *d;
+   if (desired_channels < 0 || desired_channels > 4)
+      return (koi_qoi_decoder*)koi__errpuc("bad req_comp", "Internal error");
+   d = (koi_qoi_decoder*)koi__malloc(sizeof(*d));
+   if (d == NULL)
+      return (koi_qoi_decoder*)koi__errpuc("outofmem", "Out of memory");
+   memset(d, 0, sizeof(*d));
+   d->req_comp = desired_channels;
+   d->px.a = 255;
+   return d;
+}
+
+KOIDEF void koi_qoi_decoder_free(koi_qoi_decoder *d)
+{
+   if (d) {
+      koi__free(d->row_buf);
+      koi__free(d->in);
+      koi__free(d);
+   }
+}
+
+KOIDEF koi_uc *koi_qoi_decoder_buffer(koi_qoi_decoder *d, int len)
+{
+   koi_uc *grown;
+   int left, cap;
+
+   if (d->failed) return NULL;
+   if (len < 0) return koi__errpuc("bad len", "Negative length");
+
+   // drop what has been decoded already, then make room
+   left = d->in_len - d->in_pos;
+   if (d->in_pos) {
+      memmove(d->in, d->in + d->in_pos, left);
+      d->in_pos = 0;
+      d->in_len = left;
+   }
+   // allocate even for len 0, so that NULL is only ever an error
+   if (len > d->in_cap - left || d->in == NULL) {
+      if (len > INT_MAX - left) return koi__errpuc("too large", "Too much unprocessed input");
+      cap = d->in_cap > (INT_MAX - 1) / 2 ? INT_MAX : d->in_cap * 2;
+      if (cap < left + len) cap = left + len;
+      if (cap < 256) cap = 256;
+      grown = (koi_uc*)koi__realloc_sized(d->in, d->in_cap, cap);
+      if (grown == NULL) return koi__errpuc("outofmem", "Out of memory");
+      d->in = grown;
+      d->in_cap = cap;
+   }
+   d->in_room = len;
+   return d->in + d->in_len;
+}
+
+KOIDEF int koi_qoi_decoder_commit(koi_qoi_decoder *d, int len)
+{
+   if (d->failed) return 0;
+   if (len < 0 || len > d->in_room) return koi__err("bad len", "More bytes than koi_qoi_decoder_buffer made room for");
+   d->in_len += len;
+   d->in_room = 0;
+
+   koi__qoi_decoder_header(d);
+   return !d->failed;
+}
+
+KOIDEF int koi_qoi_decoder_feed(koi_qoi_decoder *d, koi_uc const *bytes, int len)
+{
+   koi_uc *p = koi_qoi_decoder_buffer(d, len);
+   if (p == NULL) return 0;
+   if (len) memcpy(p, bytes, len);
+   return koi_qoi_decoder_commit(d, len);
+}
+
+KOIDEF int koi_qoi_decoder_wanted(koi_qoi_decoder *d)
+{
+   int avail = d->in_len - d->in_pos, size;
+   koi_uc tag;
+
+   if (!koi__qoi_decoder_header(d))
+      return d->failed ? -1 : 14 - avail;
+   // nothing is missing while a run is still being handed out, or once
+   // the last row is (the end marker isn't needed)
+   if (d->row >= d->h || d->run || d->w == 0)
+      return 0;
+   if (avail == 0)
+      return 1;
+   tag = d->in[d->in_pos];
+   size = tag == 0xfe ? 4 : tag == 0xff ? 5 : (tag & 0xc0) == 0x80 ? 2 : 1;
+   return size > avail ? size - avail : 0;
+}
+
+KOIDEF int koi_qoi_decoder_info(koi_qoi_decoder *d, int *x, int *y, int *comp)
+{
+   if (!koi__qoi_decoder_header(d))
+      return 0;
+   if (x) *x = (int)d->w;
+   if (y) *y = (int)d->h;
+   if (comp) *comp = d->img_n;
+   return 1;
+}
+
+KOIDEF int koi_qoi_decoder_next_rows(koi_qoi_decoder *d, koi_uc *dst, int stride_in_bytes, int max_rows)
+{
+   koi_uc *p, *p_end, *o, po[4];
+   koi_uc tag, dg, d2;
+   koi__qoi_pixel px, *index;
+   koi__uint32 run, n;
+   int rows, size, target;
+   KOI__QOI_STATS(koi__stats_current)
+
+   if (!koi__qoi_decoder_header(d))
+      return d->failed ? -1 : 0;
+   if (stride_in_bytes == 0)
+      stride_in_bytes = d->row_bytes;
+   else if (stride_in_bytes < d->row_bytes)
+      return koi__err("bad stride", "Row stride smaller than a row of pixels") - 1; // -1, koi__err is 0
+
+   px = d->px;
+   run = d->run;
+   index = d->index;
+   target = d->target;
+   p = d->in + d->in_pos;
+   p_end = d->in + d->in_len;
+   koi__qoi_pack(po, px, target);
+
+   for (rows = 0; rows < max_rows && d->row < d->h; ++rows) {
+      o = d->row_buf + (size_t)d->col * target;
+      while (d->col < d->w) {
+         if (run == 0) {
+            // only take a chunk once all of its bytes are here
+            if (p == p_end) goto need_input;
+            tag = *p;
+            size = tag == 0xfe ? 4 : tag == 0xff ? 5 : (tag & 0xc0) == 0x80 ? 2 : 1;
+            if (p_end - p < size) goto need_input;
+            KOI__QOI_DECODE_OP(*p++);
+            koi__qoi_pack(po, px, target);
+         }
+         n = d->w - d->col;
+         if (n > run) n = run;
+         run -= n;
+         d->col += n;
+         for (; n; --n, o += target)
+            memcpy(o, po, target);
+      }
+      memcpy(dst + (size_t)rows * stride_in_bytes, d->row_buf, d->row_bytes);
+      d->col = 0;
+      ++d->row;
+   }
+   // a run still pending after the last row is corrupt data, it is dropped
+
+need_input:
+   d->px = px;
+   d->run = run;
+   d->in_pos = (int)(p - d->in);
+   return rows;
+}
+
+#undef KOI__QOI_PACK_1
+#undef KOI__QOI_PACK_2
+#undef KOI__QOI_PACK_3
+#undef KOI__QOI_PACK_4
+#undef KOI__QOI_STORE_1
+#undef KOI__QOI_STORE_2
+#undef KOI__QOI_STORE_3
+#undef KOI__QOI_STORE_4
+#undef KOI__QOI_WIDEN_8
+#undef KOI__QOI_WIDEN_16
+#undef KOI__QOI_WIDEN_F
+#undef KOI__QOI_WIDEN_FA
+#undef KOI__QOI_DECODE_OP
+#undef KOI__QOI_STATS
+#undef KOI__QOI_COLOR_HASH
+#undef KOI__QOI_MAX_OP
+
+// an animation written by koi_qoi_anim_begin in koi_image_write.h, decoded
+// from the caller's buffer. 'frame' is the frame decoded last, and 'index'
+// and 'px' are the state the frame after it starts from
+struct koi_qoi_anim
+{
+   koi_uc const *data;
+   koi__uint32 w, h, count, table; // 'table' is where the frame offsets start
+   int img_n, target;
+   int next;                       // the frame 'index' and 'px' are for, -1 if none
+   koi__qoi_pixel index[64], px;
+   koi_uc *frame;
+};
+
+KOIDEF koi_qoi_anim *koi_qoi_anim_open_memory(koi_uc const *buffer, int len, int desired_channels)
+{
+   koi_qoi_anim *a;
+   koi__uint32 w, h, count, table, i, off, prev;
+   int n, target;
+
+   if (desired_channels < 0 || desired_channels > 4)
+      return (koi_qoi_anim*)koi__errpuc("bad req_comp", "Internal error");
+   if (buffer == NULL || len < 24 || memcmp(buffer, "koia", 4) != 0 || memcmp(buffer + len - 4, "koif", 4) != 0)
+      return (koi_qoi_anim*)koi__errpuc("not koia", "Not a QOI animation");
+
+   w = koi__qoi_be32(buffer + 4);
+   h = koi__qoi_be32(buffer + 8);
+   n = buffer[12];
+   if ((n != 3 && n != 4) || buffer[13] > 1)
+      return (koi_qoi_anim*)koi__errpuc("corrupt", "Corrupt QOI animation");
+   if (w > KOI_MAX_DIMENSIONS || h > KOI_MAX_DIMENSIONS)
+      return (koi_qoi_anim*)koi__errpuc("too large", "Very large image (corrupt?)");
+
+   // every frame is at least its flags byte, the first one a key frame
+   count = koi__qoi_be32(buffer + len - 8);
+   if (count == 0 || count > ((koi__uint32)len - 24) / 4)
+      return (koi_qoi_anim*)koi__errpuc("corrupt", "Corrupt QOI animation");
+   table = (koi__uint32)len - 8 - 4 * count;
+   for (i = 0, prev = 15; i < count; ++i, prev = off) {
+      off = koi__qoi_be32(buffer + table + 4 * i);
+      if (off <= prev || off >= table || (i == 0 && off != 16))
+         return (koi_qoi_anim*)koi__errpuc("corrupt", "Corrupt QOI animation");
+   }
+   if (!(buffer[16] & 1))
+      return (koi_qoi_anim*)koi__errpuc("corrupt", "Corrupt QOI animation");
+
+   target = desired_channels ? desired_channels : n;
+   if (koi__qoi_decode_row[0][target - 1] == NULL)
+      return (koi_qoi_anim*)koi__errpuc("unsupported", "Output layout left out by KOI_ONLY_*");
+   if (!koi__mad3sizes_valid((int)w, (int)h, target, 1))
+      return (koi_qoi_anim*)koi__errpuc("too large", "Image too large to decode");
+
+   a = (koi_qoi_anim*)koi__malloc(sizeof(*a));
+   if (a == NULL)
+      return (koi_qoi_anim*)koi__errpuc("outofmem", "Out of memory");
+   a->frame = (koi_uc*)koi__malloc((size_t)w * h * target + 1);
+   if (a->frame == NULL) {
+      koi__free(a);
+      return (koi_qoi_anim*)koi__errpuc("outofmem", "Out of memory");
+   }
+   a->data = buffer;
+   a->w = w;
+   a->h = h;
+   a->count = count;
+   a->table = table;
+   a->img_n = n;
+   a->target = target;
+   a->next = -1;
+   return a;
+}
+
+KOIDEF void koi_qoi_anim_close(koi_qoi_anim *a)
+{
+   if (a) {
+      koi__free(a->frame);
+      koi__free(a);
+   }
+}
+
+KOIDEF int koi_qoi_anim_info(koi_qoi_anim *a, int *x, int *y, int *channels_in_file, int *frames)
+{
+   if (x) *x = (int)a->w;
+   if (y) *y = (int)a->h;
+   if (channels_in_file) *channels_in_file = a->img_n;
+   if (frames) *frames = (int)a->count;
+   return 1;
+}
+
+static koi__uint32 koi__qoi_anim_offset(koi_qoi_anim *a, koi__uint32 f)
+{
+   return f < a->count ? koi__qoi_be32(a->data + a->table + 4 * f) : a->table;
+}
+
+// decode frame 'f' over the one before it, see koiw__qoi_anim_frame for
+// the layout; 0 if it is corrupt
+static int koi__qoi_anim_decode(koi_qoi_anim *a, koi__uint32 f)
+{
+   koi__qoi_decode_row_func *decode_row = koi__qoi_decode_row[0][a->target - 1];
+   koi__uint32 start = koi__qoi_anim_offset(a, f), r, skip, n, run;
+   size_t row_bytes = (size_t)a->w * a->target;
+   koi__context s;
+   int key;
+
+   koi__start_mem(&s, a->data + start, (int)(koi__qoi_anim_offset(a, f + 1) - start));
+   key = koi__get8(&s) & 1;
+   if (key) {
+      memset(a->index, 0, sizeof(a->index));
+      a->px.r = a->px.g = a->px.b = 0;
+      a->px.a = 255;
+   }
+   for (r = 0; r < a->h; ) {
+      if (s.img_buffer_end - s.img_buffer < 8)
+         return 0;
+      skip = koi__get32be(&s);
+      n = koi__get32be(&s);
+      if ((skip == 0 && n == 0) || (key && skip) || skip > a->h - r || n > a->h - r - skip)
+         return 0;
+      // the rows skipped are still there from the frame before
+      for (r += skip, run = 0; n; --n, ++r)
+         decode_row(&s, a->frame + r * row_bytes, a->w, a->index, &a->px, &run);
+   }
+   return 1;
+}
+
+KOIDEF koi_uc const *koi_qoi_anim_frame(koi_qoi_anim *a, int frame)
+{
+   koi__uint32 f, k;
+
+   if (frame < 0 || (koi__uint32)frame >= a->count)
+      return koi__errpuc("bad frame", "Frame number out of range");
+   f = (koi__uint32)frame;
+   if (a->next >= 0 && (koi__uint32)a->next == f + 1)
+      return a->frame;
+
+   // start at the last key frame up to 'f', or go on from the frames
+   // decoded so far if they are past that already
+   for (k = f; !(a->data[koi__qoi_anim_offset(a, k)] & 1); --k)
+      ;
+   if (a->next >= 0 && (koi__uint32)a->next <= f && (koi__uint32)a->next > k)
+      k = (koi__uint32)a->next;
+   for (; k <= f; ++k) {
+      if (!koi__qoi_anim_decode(a, k)) {
+         a->next = -1;
+         return koi__errpuc("corrupt", "Corrupt QOI animation");
+      }
+   }
+   a->next = (int)f + 1;
+   return a->frame;
+}
+
 static int koi__qoi_info(koi__context *s, int *x, int *y, int *comp)
 {
    void *p;
@@ -1247,8 +3125,18 @@ static int koi__info_main(koi__context *s, int *x, int *y, int *comp)
 #if !defined(KOI_NO_STDIO)
 KOIDEF int koi_info(char const *filename, int *x, int *y, int *comp)
 {
-   FILE *f = koi__fopen(filename, "rb");
+   FILE *f;
    int result;
+#if defined(KOI_USE_MMAP)
+   koi__mapped_file m;
+   if (koi__map_file(&m, filename)) {
+      // only the page with the header is ever read
+      result = koi_info_from_memory(m.data, m.len, x, y, comp);
+      koi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = koi__fopen(filename, "rb");
    if (f == NULL) return koi__err("can't fopen", "Unable to open file");
    result = koi_info_from_file(f, x, y, comp);
    fclose(f);
@@ -1281,6 +3169,749 @@ KOIDEF int koi_info_from_callbacks(koi_io_callbacks const *c, void *user, int *x
    return koi__info_main(&s, x, y, comp);
 }
 
+#if !defined(KOI_NO_QOI)
+KOIDEF int koi_info_from_memory_fast(koi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   koi__uint32 w, h;
+
+   if (buffer == NULL || len < 14)
+      return koi__err("not QOI", "Corrupt QOI");
+   if (buffer[0] != 'q' || buffer[1] != 'o' || buffer[2] != 'i' || buffer[3] != 'f')
+      return koi__err("not QOI", "Corrupt QOI");
+   if (buffer[12] != 3 && buffer[12] != 4)
+      return koi__err("QOI CHANNELS", "QOI only support: 4 and 3 channels");
+   if (buffer[13] != 0 && buffer[13] != 1)
+      return koi__err("QOI COLORSPACE", "QOI only support: 0 and 1 colorspace");
+   w = (koi__uint32)buffer[4] << 24 | (koi__uint32)buffer[5] << 16 | (koi__uint32)buffer[6] << 8 | buffer[7];
+   h = (koi__uint32)buffer[8] << 24 | (koi__uint32)buffer[9] << 16 | (koi__uint32)buffer[10] << 8 | buffer[11];
+   if (x) *x = (int)w;
+   if (y) *y = (int)h;
+   if (comp) *comp = buffer[12];
+   return 1;
+}
+
+#if !defined(KOI_NO_STDIO)
+// reads the first 'len' bytes of a file with as few calls as it can; how
+// many it got, or -1 if the file can't be opened
+static int koi__read_head(char const *filename, koi_uc *buf, int len)
+{
+#if defined(KOI_USE_MMAP) && !defined(_WIN32)
+   int fd = open(filename, O_RDONLY);
+   ssize_t n;
+   if (fd < 0)
+      return -1;
+   n = read(fd, buf, (size_t)len); // just opened, so at offset 0
+   close(fd);
+   return n < 0 ? 0 : (int)n;
+#else
+   // unbuffered, so it is one read of 'len' bytes rather than a buffer's worth
+   FILE *f = koi__fopen(filename, "rb");
+   int n;
+   if (f == NULL)
+      return -1;
+   setvbuf(f, NULL, _IONBF, 0);
+   n = (int)fread(buf, 1, (size_t)len, f);
+   fclose(f);
+   return n;
+#endif
+}
+
+// this many files per dispatched job
+#define KOI__INFO_BATCH_GROUP 64
+
+typedef struct
+{
+   char const *const *filenames;
+   koi_info_result *results;
+   int n;
+} koi__info_batch;
+
+static void koi__info_batch_job(void *arg, int group)
+{
+   koi__info_batch *b = (koi__info_batch*)arg;
+   koi_info_result *r;
+   koi_uc header[14];
+   int i, i_end, got;
+
+   i = group * KOI__INFO_BATCH_GROUP;
+   i_end = (b->n - i < KOI__INFO_BATCH_GROUP) ? b->n : i + KOI__INFO_BATCH_GROUP;
+   for (; i < i_end; ++i) {
+      r = &b->results[i];
+      got = koi__read_head(b->filenames[i], header, (int)sizeof(header));
+      if (got < 0)
+         r->ok = koi__err("can't fopen", "Unable to open file");
+      else
+         r->ok = koi_info_from_memory_fast(header, got, &r->x, &r->y, &r->channels_in_file);
+      r->failure_reason = r->ok ? NULL : koi_failure_reason();
+   }
+}
+
+KOIDEF int koi_info_batch(char const *const *filenames, int n, koi_info_result *results)
+{
+   koi__info_batch b;
+   koi__dispatch dispatch = koi__dispatch_current;
+   int i, groups, ok = 0;
+
+   if (n <= 0)
+      return 0;
+   b.filenames = filenames;
+   b.results = results;
+   b.n = n;
+   groups = (n - 1) / KOI__INFO_BATCH_GROUP + 1;
+   if (dispatch.func != NULL && groups > 1)
+      dispatch.func(dispatch.context, koi__info_batch_job, &b, groups);
+   else
+      for (i = 0; i < groups; ++i)
+         koi__info_batch_job(&b, i);
+
+   for (i = 0; i < n; ++i)
+      ok += results[i].ok;
+   return ok;
+}
+
+#undef KOI__INFO_BATCH_GROUP
+#endif // !KOI_NO_STDIO
+#endif // !KOI_NO_QOI
+
+// this many images per dispatched job: small enough that an idle thread can
+// always pick up more, big enough that a job isn't all overhead
+#define KOI__BATCH_GROUP 32
+
+typedef struct
+{
+   const koi_batch_item *items;
+   koi_batch_result *results;
+   int n, req_comp, flip;
+#if defined(KOI_STATS)
+   koi_stats *stats;    // one per group, added up once they are all done
+#endif
+} koi__batch;
+
+static void koi__batch_decode(void *arg, int group)
+{
+   koi__batch *b = (koi__batch*)arg;
+   koi_batch_result *r;
+   koi__context s;
+   int i, i_end, target;
+
+   i = group * KOI__BATCH_GROUP;
+   i_end = (b->n - i < KOI__BATCH_GROUP) ? b->n : i + KOI__BATCH_GROUP;
+   for (; i < i_end; ++i) {
+      r = &b->results[i];
+      if (r->data == NULL)
+         continue; // the header was already no good
+      target = b->req_comp ? b->req_comp : r->channels_in_file;
+      koi__start_mem(&s, b->items[i].buffer, b->items[i].len);
+      s.serial = 1;
+      s.flip = b->flip; // the way the caller's thread would have
+#if defined(KOI_STATS)
+      s.stats = b->stats ? &b->stats[group] : NULL;
+#endif
+      if (!koi__load_into_main(&s, r->data, 0, r->x * r->y * target, 8, &r->x, &r->y, &r->channels_in_file, b->req_comp)) {
+         r->data = NULL;
+         r->failure_reason = koi_failure_reason();
+      }
+   }
+}
+
+KOIDEF koi_uc *koi_load_batch(const koi_batch_item *items, int n, koi_batch_result *results, int req_comp)
+{
+   koi__batch b;
+   koi__dispatch dispatch = koi__dispatch_current;
+   koi_batch_result *r;
+   koi_uc *block;
+   size_t total = 0, size;
+   int i, target, groups;
+
+   if (n <= 0)
+      return koi__errpuc("empty batch", "No images to decode");
+   if (req_comp < 0 || req_comp > 4)
+      return koi__errpuc("bad req_comp", "Internal error");
+
+   // the headers say how big every image is, so the whole block is
+   // allocated before anything is decoded. channels_in_file is 0 for the
+   // ones that can't be, since failure_reason is NULL without failure strings
+   for (i = 0; i < n; ++i) {
+      r = &results[i];
+      r->data = NULL;
+      r->failure_reason = NULL;
+      if (!koi_info_from_memory(items[i].buffer, items[i].len, &r->x, &r->y, &r->channels_in_file)) {
+         r->failure_reason = koi_failure_reason();
+         r->x = r->y = r->channels_in_file = 0;
+         continue;
+      }
+      target = req_comp ? req_comp : r->channels_in_file;
+      size = (size_t)r->x * r->y * target;
+      if (!koi__mad3sizes_valid(r->x, r->y, target, 0) || total > (size_t)-1 - size) {
+         (void)koi__err("too large", "Image too large to decode");
+         r->failure_reason = koi_failure_reason();
+         r->x = r->y = r->channels_in_file = 0;
+         continue;
+      }
+      total += size;
+   }
+
+   block = (koi_uc*)koi__malloc(total ? total : 1);
+   if (block == NULL)
+      return koi__errpuc("outofmem", "Out of memory");
+
+   total = 0;
+   for (i = 0; i < n; ++i) {
+      r = &results[i];
+      if (r->channels_in_file == 0)
+         continue;
+      target = req_comp ? req_comp : r->channels_in_file;
+      r->data = block + total;
+      total += (size_t)r->x * r->y * target;
+   }
+
+   b.items = items;
+   b.results = results;
+   b.n = n;
+   b.req_comp = req_comp;
+   b.flip = koi__vertically_flip_on_load;
+   groups = (n - 1) / KOI__BATCH_GROUP + 1;
+#if defined(KOI_STATS)
+   b.stats = NULL;
+   if (koi__stats_current) {
+      b.stats = (koi_stats*)koi__malloc(sizeof(koi_stats) * groups);
+      if (b.stats == NULL) {
+         koi__free(block);
+         return koi__errpuc("outofmem", "Out of memory");
+      }
+      memset(b.stats, 0, sizeof(koi_stats) * groups);
+   }
+#endif
+   if (dispatch.func != NULL && groups > 1)
+      dispatch.func(dispatch.context, koi__batch_decode, &b, groups);
+   else
+      for (i = 0; i < groups; ++i)
+         koi__batch_decode(&b, i);
+#if defined(KOI_STATS)
+   if (b.stats) {
+      for (i = 0; i < groups; ++i)
+         koi__stats_merge(koi__stats_current, &b.stats[i]);
+      koi__free(b.stats);
+   }
+#endif
+
+   for (i = 0; i < n; ++i)
+      if (results[i].data != NULL)
+         return block;
+   koi__free(block);
+   return NULL; // results[] say why
+}
+
+#undef KOI__BATCH_GROUP
+
+struct koi_decoder
+{
+   koi__context s; // with the I/O buffer in it; set up again for every image
+   int flip;
+   koi_uc *result;
+   size_t result_size;
+};
+
+KOIDEF koi_decoder *koi_decoder_create(void)
+{
+   koi_decoder *d = (koi_decoder*)koi__malloc(sizeof(*d));
+   if (d == NULL)
+      return (koi_decoder*)koi__errpuc("outofmem", "Out of memory");
+   d->flip = 0;
+   d->result = NULL;
+   d->result_size = 0;
+   return d;
+}
+
+KOIDEF void koi_decoder_free(koi_decoder *d)
+{
+   if (d) {
+      koi__free(d->result);
+      koi__free(d);
+   }
+}
+
+KOIDEF void koi_decoder_set_flip_vertically(koi_decoder *d, int flag_true_if_should_flip)
+{
+   d->flip = flag_true_if_should_flip != 0;
+}
+
+KOIDEF int koi_decoder_load_into_from_memory(koi_decoder *d, koi_uc const *buffer, int len, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__start_mem(&d->s, buffer, len);
+   d->s.flip = d->flip;
+   return koi__load_into_main(&d->s, dst, stride_in_bytes, dst_capacity, 8, x, y, comp, req_comp);
+}
+
+KOIDEF int koi_decoder_load_into_from_callbacks(koi_decoder *d, koi_io_callbacks const *clbk, void *user, koi_uc *dst, int stride_in_bytes, int dst_capacity, int *x, int *y, int *comp, int req_comp)
+{
+   koi__start_callbacks(&d->s, (koi_io_callbacks*)clbk, user);
+   d->s.flip = d->flip;
+   return koi__load_into_main(&d->s, dst, stride_in_bytes, dst_capacity, 8, x, y, comp, req_comp);
+}
+
+KOIDEF koi_uc *koi_decoder_load_from_memory(koi_decoder *d, koi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   int w, h, n, target;
+   size_t size;
+   koi_uc *grown;
+
+   if (req_comp < 0 || req_comp > 4)
+      return koi__errpuc("bad req_comp", "Internal error");
+   koi__start_mem(&d->s, buffer, len);
+   if (!koi__info_main(&d->s, &w, &h, &n))
+      return NULL;
+   target = req_comp ? req_comp : n;
+   if (!koi__mad3sizes_valid(w, h, target, 0))
+      return koi__errpuc("too large", "Image too large to decode");
+   size = (size_t)w * h * target;
+
+   // only ever grows, so a stream of similar images allocates once
+   if (size > d->result_size || d->result == NULL) {
+      // the old pixels aren't needed, so don't pay for a realloc copying them
+      koi__free(d->result);
+      d->result = NULL;
+      d->result_size = 0;
+      grown = (koi_uc*)koi__malloc(size ? size : 1);
+      if (grown == NULL)
+         return koi__errpuc("outofmem", "Out of memory");
+      d->result = grown;
+      d->result_size = size;
+   }
+   if (!koi_decoder_load_into_from_memory(d, buffer, len, d->result, 0, (int)size, x, y, comp, req_comp))
+      return NULL;
+   return d->result;
+}
+
+#if defined(KOI_CACHE)
+
+#if !defined(KOI_CACHE_SHARDS)
+   #define KOI_CACHE_SHARDS 16
+#endif
+
+// one lock per shard; KOI_CACHE_NO_THREADS leaves them out for single-threaded use
+#if defined(KOI_CACHE_NO_THREADS)
+   typedef int koi__cache_mutex;
+   #define koi__cache_mutex_init(m)     ((void)(m), 1)
+   #define koi__cache_mutex_destroy(m)  ((void)(m))
+   #define koi__cache_lock(m)           ((void)(m))
+   #define koi__cache_unlock(m)         ((void)(m))
+#elif defined(_WIN32)
+   typedef SRWLOCK koi__cache_mutex;
+   #define koi__cache_mutex_init(m)     (InitializeSRWLock(m), 1)
+   #define koi__cache_mutex_destroy(m)  ((void)(m))
+   #define koi__cache_lock(m)           AcquireSRWLockExclusive(m)
+   #define koi__cache_unlock(m)         ReleaseSRWLockExclusive(m)
+#else
+   typedef pthread_mutex_t koi__cache_mutex;
+   #define koi__cache_mutex_init(m)     (pthread_mutex_init(m, NULL) == 0)
+   #define koi__cache_mutex_destroy(m)  pthread_mutex_destroy(m)
+   #define koi__cache_lock(m)           pthread_mutex_lock(m)
+   #define koi__cache_unlock(m)         pthread_mutex_unlock(m)
+#endif
+
+// a decoded image, allocated in one block with its pixels (and, with
+// KOI_CACHE_VERIFY, a copy of the input after them). The key is everything
+// from 'h1' to 'scale'
+typedef struct koi__cache_entry
+{
+   struct koi__cache_entry *chain;         // next in the same bucket
+   struct koi__cache_entry *newer, *older; // the shard's LRU list
+   koi__uint32 h1, h2;
+   int len, req_comp, bits, flip;
+   float gamma, scale;                     // koi_ldr_to_hdr_* for koi_cache_loadf
+   int x, y, n;
+   int refs;                               // results not released yet
+   int cached;                             // 0 once evicted, freed on the last release
+   int shard;
+   size_t bytes;
+} koi__cache_entry;
+
+// keeps the pixels as aligned as the allocator keeps the block
+#define KOI__CACHE_HEADER        ((sizeof(koi__cache_entry) + 15) & ~(size_t)15)
+#define KOI__CACHE_PIXELS(e)     ((koi_uc*)(e) + KOI__CACHE_HEADER)
+#define KOI__CACHE_ENTRY(p)      ((koi__cache_entry*)((koi_uc*)(p) - KOI__CACHE_HEADER))
+
+typedef struct
+{
+   koi__cache_mutex lock;
+   koi__cache_entry **buckets;
+   koi__uint32 bucket_count, count;
+   koi__cache_entry *newest, *oldest;
+} koi__cache_shard;
+
+struct koi_cache
+{
+   koi__cache_shard shard[KOI_CACHE_SHARDS];
+   koi__cache_mutex lock;                  // 'bytes' and 'hand', taken after a shard's lock
+   size_t bytes, budget;
+   int hand;                               // the shard to evict from next
+   koi_allocator alloc;                    // the allocator set when the cache was created
+   int has_alloc;
+};
+
+// the cache allocates with what was set at koi_cache_create, since images
+// are freed on whichever thread evicts or releases them
+static void *koi__cache_malloc(koi_cache *c, size_t size)
+{
+   return c->has_alloc ? c->alloc.alloc_fn(c->alloc.user, size) : KOI_MALLOC(size);
+}
+
+static void koi__cache_free(koi_cache *c, void *p)
+{
+   if (c->has_alloc)
+      c->alloc.free_fn(c->alloc.user, p);
+   else
+      KOI_FREE(p);
+}
+
+#define koi__cache_rotl(x, k)  (((x) << (k)) | ((x) >> (32 - (k))))
+
+static koi__uint32 koi__cache_fmix(koi__uint32 h)
+{
+   h ^= h >> 16; h *= 0x85ebca6bu;
+   h ^= h >> 13; h *= 0xc2b2ae35u;
+   h ^= h >> 16;
+   return h;
+}
+
+// 64 bits of hash over two independent lanes, so that the multiplies of one
+// word don't wait for the previous one; the result only lives in this process,
+// so memcpy in native byte order is fine
+static void koi__cache_hash(koi_uc const *p, int len, koi__uint32 *h1, koi__uint32 *h2)
+{
+   koi__uint32 a = 0x9e3779b9u ^ (koi__uint32)len, b = 0x85ebca6bu + (koi__uint32)len, w0, w1;
+   int i = 0;
+
+   for (; i + 8 <= len; i += 8) {
+      memcpy(&w0, p + i, 4);
+      memcpy(&w1, p + i + 4, 4);
+      w0 *= 0xcc9e2d51u;
+      w1 *= 0x1b873593u;
+      a = koi__cache_rotl(a ^ w0, 13) * 5 + 0xe6546b64u;
+      b = koi__cache_rotl(b ^ w1, 15) * 5 + 0x52dce729u;
+   }
+   for (; i < len; ++i)
+      a = (a ^ p[i]) * 0x01000193u;
+   // both halves depend on both lanes, and (a, b) can be recovered from them
+   a = koi__cache_fmix(a ^ koi__cache_rotl(b, 16));
+   b = koi__cache_fmix(b ^ a);
+   *h1 = a;
+   *h2 = b;
+}
+
+static koi__cache_entry *koi__cache_find(koi__cache_shard *sh, koi__cache_entry const *key, koi_uc const *buffer)
+{
+   koi__cache_entry *e;
+   if (sh->bucket_count == 0)
+      return NULL;
+   for (e = sh->buckets[key->h2 & (sh->bucket_count - 1)]; e; e = e->chain) {
+      if (e->h1 == key->h1 && e->h2 == key->h2 && e->len == key->len && e->req_comp == key->req_comp &&
+          e->bits == key->bits && e->flip == key->flip && e->gamma == key->gamma && e->scale == key->scale) {
+#if defined(KOI_CACHE_VERIFY)
+         if (memcmp(KOI__CACHE_PIXELS(e) + (e->bytes - KOI__CACHE_HEADER - e->len), buffer, e->len) != 0)
+            continue;
+#else
+         (void)buffer;
+#endif
+         return e;
+      }
+   }
+   return NULL;
+}
+
+static void koi__cache_unlink_lru(koi__cache_shard *sh, koi__cache_entry *e)
+{
+   if (e->newer) e->newer->older = e->older; else sh->newest = e->older;
+   if (e->older) e->older->newer = e->newer; else sh->oldest = e->newer;
+}
+
+static void koi__cache_push_lru(koi__cache_shard *sh, koi__cache_entry *e)
+{
+   e->newer = NULL;
+   e->older = sh->newest;
+   if (sh->newest) sh->newest->newer = e; else sh->oldest = e;
+   sh->newest = e;
+}
+
+// with the shard locked; 0 if the buckets couldn't grow
+static int koi__cache_insert(koi_cache *c, koi__cache_shard *sh, koi__cache_entry *e)
+{
+   koi__cache_entry **buckets, *next;
+   koi__uint32 count, i, j;
+
+   if (sh->count >= sh->bucket_count) {
+      count = sh->bucket_count ? sh->bucket_count * 2 : 16;
+      buckets = (koi__cache_entry**)koi__cache_malloc(c, count * sizeof(*buckets));
+      if (buckets == NULL) {
+         if (sh->bucket_count == 0)
+            return 0;
+      } else {
+         for (j = 0; j < count; ++j)
+            buckets[j] = NULL;
+         for (i = 0; i < sh->bucket_count; ++i) {
+            for (next = sh->buckets[i]; next; ) {
+               koi__cache_entry *moved = next;
+               next = next->chain;
+               moved->chain = buckets[moved->h2 & (count - 1)];
+               buckets[moved->h2 & (count - 1)] = moved;
+            }
+         }
+         if (sh->buckets)
+            koi__cache_free(c, sh->buckets);
+         sh->buckets = buckets;
+         sh->bucket_count = count;
+      }
+   }
+   i = e->h2 & (sh->bucket_count - 1);
+   e->chain = sh->buckets[i];
+   sh->buckets[i] = e;
+   koi__cache_push_lru(sh, e);
+   ++sh->count;
+   e->cached = 1;
+   return 1;
+}
+
+// with the shard locked; entries still in use are freed by their last release
+static void koi__cache_evict(koi_cache *c, koi__cache_shard *sh, koi__cache_entry *e)
+{
+   koi__cache_entry **link = &sh->buckets[e->h2 & (sh->bucket_count - 1)];
+   while (*link != e)
+      link = &(*link)->chain;
+   *link = e->chain;
+   koi__cache_unlink_lru(sh, e);
+   --sh->count;
+   e->cached = 0;
+
+   koi__cache_lock(&c->lock);
+   c->bytes -= e->bytes;
+   koi__cache_unlock(&c->lock);
+   if (e->refs == 0)
+      koi__cache_free(c, e);
+}
+
+// evicts the least recently used image of each shard in turn until the
+// cache is back within its budget, or nothing but 'keep' is left to evict.
+// Only one lock is held at a time, apart from c->lock inside a shard's, so
+// loads in other shards carry on
+static void koi__cache_trim(koi_cache *c, koi__cache_entry *keep)
+{
+   koi__cache_shard *sh;
+   int over, i, idle = 0;
+
+   while (idle < KOI_CACHE_SHARDS) {
+      koi__cache_lock(&c->lock);
+      over = c->bytes > c->budget;
+      i = c->hand;
+      if (over)
+         c->hand = (i + 1) % KOI_CACHE_SHARDS;
+      koi__cache_unlock(&c->lock);
+      if (!over)
+         break;
+
+      sh = &c->shard[i];
+      koi__cache_lock(&sh->lock);
+      if (sh->oldest && sh->oldest != keep) {
+         koi__cache_evict(c, sh, sh->oldest);
+         idle = 0;
+      } else {
+         ++idle;
+      }
+      koi__cache_unlock(&sh->lock);
+   }
+}
+
+static void *koi__cache_result(koi__cache_entry *e, int *x, int *y, int *comp)
+{
+   *x = e->x;
+   *y = e->y;
+   if (comp) *comp = e->n;
+   return KOI__CACHE_PIXELS(e);
+}
+
+static void *koi__cache_load(koi_cache *c, koi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int bits)
+{
+   koi__cache_entry key, *e, *found;
+   koi__cache_shard *sh;
+   koi__context s;
+   int w, h, n, target, inserted;
+   size_t size, extra = 0;
+
+   if (req_comp < 0 || req_comp > 4)
+      return koi__errpuc("bad req_comp", "Internal error");
+
+   memset(&key, 0, sizeof(key));
+   koi__cache_hash(buffer, len, &key.h1, &key.h2);
+   key.len = len;
+   key.req_comp = req_comp;
+   key.bits = bits;
+   key.flip = koi__vertically_flip_on_load != 0;
+#if !defined(KOI_NO_LINEAR)
+   if (bits == 32) {
+      key.gamma = koi__l2h_gamma;
+      key.scale = koi__l2h_scale;
+   }
+#endif
+   key.shard = (int)(key.h1 % KOI_CACHE_SHARDS);
+   sh = &c->shard[key.shard];
+
+   koi__cache_lock(&sh->lock);
+   e = koi__cache_find(sh, &key, buffer);
+   if (e) {
+      ++e->refs;
+      koi__cache_unlink_lru(sh, e);
+      koi__cache_push_lru(sh, e);
+   }
+   koi__cache_unlock(&sh->lock);
+   if (e)
+      return koi__cache_result(e, x, y, comp);
+
+   // decode without holding the lock, so a miss doesn't hold up the shard
+   koi__start_mem(&s, buffer, len);
+   if (!koi__info_main(&s, &w, &h, &n))
+      return NULL;
+   target = req_comp ? req_comp : n;
+   if (!koi__mad4sizes_valid(w, h, target, bits / 8, 0))
+      return koi__errpuc("too large", "Image too large to decode");
+   size = (size_t)w * h * target * (bits / 8);
+#if defined(KOI_CACHE_VERIFY)
+   extra = (size_t)len;
+#endif
+   e = (koi__cache_entry*)koi__cache_malloc(c, KOI__CACHE_HEADER + size + extra);
+   if (e == NULL)
+      return koi__errpuc("outofmem", "Out of memory");
+   *e = key;
+   e->refs = 1;
+   e->bytes = KOI__CACHE_HEADER + size + extra;
+
+   koi__start_mem(&s, buffer, len);
+   if (!koi__load_into_main(&s, KOI__CACHE_PIXELS(e), 0, (int)size, bits, &e->x, &e->y, &e->n, req_comp)) {
+      koi__cache_free(c, e);
+      return NULL;
+   }
+#if defined(KOI_CACHE_VERIFY)
+   memcpy(KOI__CACHE_PIXELS(e) + size, buffer, len);
+#endif
+
+   // an image bigger than the whole budget is handed out but never kept
+   if (e->bytes > c->budget)
+      return koi__cache_result(e, x, y, comp);
+
+   koi__cache_lock(&sh->lock);
+   // another thread may have decoded the same bytes meanwhile; share theirs
+   found = koi__cache_find(sh, &key, buffer);
+   if (found) {
+      ++found->refs;
+      koi__cache_unlink_lru(sh, found);
+      koi__cache_push_lru(sh, found);
+      inserted = 0;
+   } else {
+      inserted = koi__cache_insert(c, sh, e);
+   }
+   if (inserted) {
+      koi__cache_lock(&c->lock);
+      c->bytes += e->bytes;
+      koi__cache_unlock(&c->lock);
+   }
+   koi__cache_unlock(&sh->lock);
+
+   if (found) {
+      koi__cache_free(c, e);
+      e = found;
+   } else if (inserted) {
+      koi__cache_trim(c, e);
+   }
+   return koi__cache_result(e, x, y, comp);
+}
+
+KOIDEF koi_cache *koi_cache_create(size_t byte_budget)
+{
+   koi_allocator const *a = koi__allocator();
+   koi_cache *c = (koi_cache*)koi__malloc(sizeof(*c));
+   int i;
+
+   if (c == NULL)
+      return (koi_cache*)koi__errpuc("outofmem", "Out of memory");
+   memset(c, 0, sizeof(*c));
+   c->budget = byte_budget;
+   if (a) {
+      c->alloc = *a;
+      c->has_alloc = 1;
+   }
+   if (!koi__cache_mutex_init(&c->lock)) {
+      koi__cache_free(c, c);
+      return (koi_cache*)koi__errpuc("no lock", "Can't create a lock");
+   }
+   for (i = 0; i < KOI_CACHE_SHARDS; ++i) {
+      if (!koi__cache_mutex_init(&c->shard[i].lock)) {
+         while (i-- > 0)
+            koi__cache_mutex_destroy(&c->shard[i].lock);
+         koi__cache_mutex_destroy(&c->lock);
+         koi__cache_free(c, c);
+         return (koi_cache*)koi__errpuc("no lock", "Can't create a lock");
+      }
+   }
+   return c;
+}
+
+KOIDEF void koi_cache_free(koi_cache *c)
+{
+   koi__cache_entry *e, *older;
+   int i;
+
+   if (c == NULL)
+      return;
+   for (i = 0; i < KOI_CACHE_SHARDS; ++i) {
+      koi__cache_shard *sh = &c->shard[i];
+      for (e = sh->oldest; e; e = older) {
+         older = e->newer;
+         KOI_ASSERT(e->refs == 0);
+         koi__cache_free(c, e);
+      }
+      if (sh->buckets)
+         koi__cache_free(c, sh->buckets);
+      koi__cache_mutex_destroy(&sh->lock);
+   }
+   koi__cache_mutex_destroy(&c->lock);
+   koi__cache_free(c, c);
+}
+
+KOIDEF koi_uc const *koi_cache_load_from_memory(koi_cache *c, koi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   return (koi_uc const*)koi__cache_load(c, buffer, len, x, y, comp, req_comp, 8);
+}
+
+KOIDEF koi_us const *koi_cache_load_16_from_memory(koi_cache *c, koi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   return (koi_us const*)koi__cache_load(c, buffer, len, x, y, comp, req_comp, 16);
+}
+
+#if !defined(KOI_NO_LINEAR)
+KOIDEF float const *koi_cache_loadf_from_memory(koi_cache *c, koi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   return (float const*)koi__cache_load(c, buffer, len, x, y, comp, req_comp, 32);
+}
+#endif
+
+KOIDEF void koi_cache_release(koi_cache *c, void const *pixels)
+{
+   koi__cache_entry *e;
+   koi__cache_shard *sh;
+   int unused;
+
+   if (pixels == NULL)
+      return;
+   e = KOI__CACHE_ENTRY(pixels);
+   sh = &c->shard[e->shard];
+   koi__cache_lock(&sh->lock);
+   unused = --e->refs == 0 && !e->cached;
+   koi__cache_unlock(&sh->lock);
+   if (unused)
+      koi__cache_free(c, e);
+}
+
+#endif // KOI_CACHE
+
 #endif // KOI_IMAGE_IMPLEMENTATION
 
 /*
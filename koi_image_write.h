@@ -14,6 +14,8 @@
    #include "koi_image_write.h"
 
    You can #define KOI_WRITE_ASSERT(x) before the #include to avoid using assert.h.
+   And #define KOI_WRITE_MALLOC and KOI_WRITE_FREE to avoid using malloc, free
+   And #define KOI_WRITE_NO_SIMD to keep the encoder to plain C on SSE2 and NEON targets.
 
 
    QUICK NOTES:
@@ -87,6 +89,133 @@ RECENT REVISION HISTORY:
 // where the callback is:
 //    void koi_write_func(void *context, void *data, int size);
 //
+// If the rows of your image are not tightly packed (e.g. a mapped GPU readback
+// buffer with rows aligned to 256 bytes), use the _stride versions, where
+// 'stride_in_bytes' is the distance in bytes from the start of one row to the
+// start of the next, or 0 for tightly packed rows:
+//
+//    int koi_write_qoi_stride(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
+//    int koi_write_qoi_stride_to_func(koi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+//
+// To encode into memory, ask for the worst-case size first and encode
+// straight into a buffer of that size; the _to_memory functions return the
+// number of bytes written, or 0 if it failed (or the buffer was too small):
+//
+//    int koi_write_qoi_bound(int w, int h, int comp);   // 0 if it would not fit in an int
+//    int koi_write_qoi_to_memory(void *dst, int capacity, int w, int h, int comp, const void *data);
+//    int koi_write_qoi_stride_to_memory(void *dst, int capacity, int w, int h, int comp, const void *data, int stride_in_bytes);
+//
+// A smaller buffer works too, as long as the encoded image happens to fit.
+//
+// If the image is produced a few rows at a time (tiles of a GPU readback,
+// say), it can be encoded as the rows arrive, without ever holding all of
+// it in memory:
+//
+//    koi_qoi_encoder *e = koi_qoi_encoder_begin(func, context, w, h, comp);
+//    while (... more rows ...)
+//       koi_qoi_encoder_push_rows(e, rows, num_rows, stride_in_bytes);
+//    ok = koi_qoi_encoder_end(e);
+//
+// The header goes out from koi_qoi_encoder_begin, which returns NULL on
+// failure. koi_qoi_encoder_end finishes the stream and frees the encoder. It
+// returns 0 if anything failed along the way or fewer than 'h' rows were
+// pushed. Rows are always taken top to bottom;
+// koi_set_flip_vertically_on_write does not apply here. The encoder object
+// holds a KOI_IO_BUFFER_SIZE output buffer and is allocated like any other
+// temporary buffer (see ALLOCATION below).
+//
+// Frame sequences (animations, screen recordings) can go into one file,
+// where every frame picks up the QOI index and previous pixel where the
+// frame before it left off, and rows that didn't change aren't stored at
+// all:
+//
+//    koi_qoi_anim_encoder *a = koi_qoi_anim_begin(func, context, w, h, comp, keyframe_interval);
+//    for (...)
+//       koi_qoi_anim_add_frame(a, frame, stride_in_bytes);
+//    ok = koi_qoi_anim_end(a);
+//
+// Every 'keyframe_interval'-th frame (0 for only the first) starts from
+// scratch, which bounds how far koi_qoi_anim_frame in koi_image.h has to go
+// back to get to any frame. The file is not a QOI file (it starts with
+// "koia"), and ends in a table of where each frame starts. The encoder keeps
+// a copy of the last frame to find the unchanged rows. As with
+// koi_qoi_encoder, rows are taken top to bottom and the flip and stripe
+// settings don't apply; koi_qoi_anim_end writes the table and frees 'a'.
+//
+// Programs that write many images in a row can keep a koi_encoder around
+// instead:
+//
+//    koi_encoder *e = koi_encoder_create();
+//    koi_encoder_set_flip_vertically(e, 1);
+//    for (...)
+//       n = koi_encoder_write_qoi_to_memory(e, dst, capacity, w, h, comp, data, stride_in_bytes);
+//    koi_encoder_free(e);
+//
+// It holds its own KOI_IO_BUFFER_SIZE output buffer, off the stack, and its
+// own options, so the koi_set_*_on_write settings don't apply to it;
+// koi_encoder_qoi_bound is koi_write_qoi_bound for its options.
+//
+// Encoding speed can be traded for size:
+//
+//    koi_set_qoi_effort_on_write(0);
+//
+// Effort 0 only looks for runs and writes every other pixel as a full
+// QOI_OP_RGB or QOI_OP_RGBA, skipping the index and the DIFF/LUMA math;
+// it is for live capture, where the bytes are cheaper than the time. The
+// default, 1, uses every chunk type. For a given image that already gives
+// the smallest QOI stream there is (every pixel gets the shortest chunk
+// that can code it, and none of the choices change what later pixels can
+// use), so there is no slower, smaller level. koi_encoder_set_qoi_effort
+// sets it for a koi_encoder. The output of either is read by any QOI
+// decoder. See benchmarks/koi_benchmark.c for how fast and how big each
+// level is on your images.
+//
+// QOI is one sequential stream, so a single image is encoded on a single
+// core. To spread large images over several, split them in stripes:
+//
+//    koi_set_qoi_stripe_rows_on_write(rows_per_stripe);
+//    koi_set_write_dispatch(func, context);
+//
+// Each stripe starts from a state that does not depend on the stripes
+// before it (its first pixel is a full QOI_OP_RGB/QOI_OP_RGBA and it never
+// refers to index entries from earlier stripes), so the stripes can be
+// encoded, and later decoded, independently. The result is still a single
+// valid QOI stream that any decoder reads; after the end marker comes a
+// table that decoders who don't know about it ignore:
+//
+//    u32 offset[count]   byte offset of each stripe from the start of the file
+//    u32 rows_per_stripe
+//    u32 count
+//    'k' 'o' 'i' 's'
+//
+// all big endian. Striped files are a little larger than single stream ones,
+// and koi_write_qoi_bound accounts for the table. The dispatch function gets
+// one job per stripe and must run job(arg, i) for every i from 0 to count-1,
+// on whatever threads it likes, returning only once they are all done; koi
+// never creates threads itself. Without one the stripes are encoded one
+// after another on the calling thread. The streaming encoder always writes a
+// single stream.
+//
+// ===========================================================================
+//
+// ALLOCATION
+//
+//   The writer allocates temporary buffers (stripes, encoder objects) with
+//   KOI_WRITE_MALLOC/KOI_WRITE_FREE, or with an allocator set at run time:
+//
+//      koi_allocator a = { my_alloc, my_realloc, my_free, my_arena };
+//      koi_set_write_allocator_thread(&a);   // or koi_set_write_allocator for all threads
+//
+//   koi_allocator is the same struct koi_image.h uses, so one arena can
+//   serve both. Nothing the writer allocates outlives the call that
+//   allocated it, except the objects that are freed by a later call:
+//
+//      koi_qoi_encoder       until koi_qoi_encoder_end
+//      koi_qoi_anim_encoder  until koi_qoi_anim_end
+//      koi_encoder           until koi_encoder_free
+//
+//   Keep the same allocator set until those calls return.
+//
 // ===========================================================================
 //
 // UNICODE
@@ -131,6 +260,19 @@ RECENT REVISION HISTORY:
 // - You can define KOI_WRITE_NO_STDIO to disable the file variant of these
 //   functions, so the library will not use stdio.h at all.
 //
+// - Output is collected in a buffer of KOI_IO_BUFFER_SIZE bytes (32 KB unless
+//   you #define it yourself) before it is handed to the write function or
+//   fwrite. The buffer lives on the stack of every save call, so lower it if
+//   your threads have small stacks.
+//
+// - #define KOI_WRITE_STATS, for the implementation and every file that uses
+//   it, to add koi_write_stats and koi_set_write_stats(_thread). Saves then
+//   add to the struct you point them at: how many of each QOI chunk they
+//   wrote, calls to the write function and the bytes and time spent in it,
+//   allocations, and the time of the whole save. Times use
+//   KOI_WRITE_STATS_CLOCK(), seconds as a double, clock() unless you
+//   #define your own. Without KOI_WRITE_STATS none of it is compiled in.
+//
 // - You can set this global variables that will be use in save functions:
 //
 //      void koi_set_qoi_color_space_on_write(int value);   // defaults to 0 (sRGB); set to 1 to tell other that save values are linear.
@@ -146,6 +288,15 @@ RECENT REVISION HISTORY:
 //    doesn't require you to disable them explicitly):
 //
 //        KOI_WRITE_ONLY_QOI
+//
+//  - QOI is encoded by one row loop per input layout. To keep only the
+//    ones you save, #define one or more of
+//
+//        KOI_WRITE_ONLY_GREY8    KOI_WRITE_ONLY_GREY_ALPHA8
+//        KOI_WRITE_ONLY_RGB8     KOI_WRITE_ONLY_RGBA8
+//
+//    before creating the implementation. Saving any other number of
+//    components then fails.
 
 #define KOI_IMAGE_WRITE_VERSION 2
 
@@ -168,6 +319,7 @@ extern "C" {
 
 #if !defined(KOI_WRITE_NO_STDIO)
 KOIWDEF int koi_write_qoi(char const *filename, int w, int h, int comp, const void *data);
+KOIWDEF int koi_write_qoi_stride(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
 
    #if defined(KOI_WRITE_WINDOWS_UTF8)
 KOIWDEF int koiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t *input);
@@ -178,25 +330,112 @@ typedef void koi_write_func(void *context, void *data, int size);
 
 #if !defined(KOI_WRITE_NO_QOI)
 KOIWDEF int koi_write_qoi_to_func(koi_write_func *func, void *context, int w, int h, int comp, const void *data);
+KOIWDEF int koi_write_qoi_stride_to_func(koi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+
+KOIWDEF int koi_write_qoi_bound(int w, int h, int comp);
+KOIWDEF int koi_write_qoi_to_memory(void *dst, int capacity, int w, int h, int comp, const void *data);
+KOIWDEF int koi_write_qoi_stride_to_memory(void *dst, int capacity, int w, int h, int comp, const void *data, int stride_in_bytes);
+
+typedef struct koi_qoi_encoder koi_qoi_encoder;
+
+KOIWDEF koi_qoi_encoder *koi_qoi_encoder_begin(koi_write_func *func, void *context, int w, int h, int comp);
+KOIWDEF int koi_qoi_encoder_push_rows(koi_qoi_encoder *e, const void *rows, int num_rows, int stride_in_bytes);
+KOIWDEF int koi_qoi_encoder_end(koi_qoi_encoder *e);
+
+// a sequence of frames of the same size in one file, each coded against the
+// one before it; see koi_qoi_anim_open_memory in koi_image.h
+typedef struct koi_qoi_anim_encoder koi_qoi_anim_encoder;
+
+KOIWDEF koi_qoi_anim_encoder *koi_qoi_anim_begin(koi_write_func *func, void *context, int w, int h, int comp, int keyframe_interval);
+KOIWDEF int koi_qoi_anim_add_frame(koi_qoi_anim_encoder *e, const void *data, int stride_in_bytes);
+KOIWDEF int koi_qoi_anim_end(koi_qoi_anim_encoder *e);
+
+// a reusable encoder: it owns its output buffer and its own options (which
+// start out at their defaults, whatever the koi_set_*_on_write settings are),
+// so writing many images in a row doesn't set any of that up again. an
+// encoder is used by one thread at a time
+typedef struct koi_encoder koi_encoder;
+
+KOIWDEF koi_encoder *koi_encoder_create(void);
+KOIWDEF void koi_encoder_free(koi_encoder *e);
+KOIWDEF void koi_encoder_set_flip_vertically(koi_encoder *e, int flag_true_if_should_flip);
+KOIWDEF void koi_encoder_set_qoi_color_space(koi_encoder *e, int qoi_color_space);
+KOIWDEF void koi_encoder_set_qoi_stripe_rows(koi_encoder *e, int rows_per_stripe);
+KOIWDEF void koi_encoder_set_qoi_effort(koi_encoder *e, int effort);
+KOIWDEF int koi_encoder_qoi_bound(koi_encoder *e, int w, int h, int comp);
+KOIWDEF int koi_encoder_write_qoi_to_func(koi_encoder *e, koi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes);
+KOIWDEF int koi_encoder_write_qoi_to_memory(koi_encoder *e, void *dst, int capacity, int w, int h, int comp, const void *data, int stride_in_bytes);
 #endif
 
 // get a VERY brief reason for failure
 // on most compilers (and ALL modern mainstream compilers) this is threadsafe
 KOIWDEF const char *koiw_failure_reason(void);
 
+// where the writer gets its temporary memory from; 'realloc_fn' may be NULL.
+// shared with koi_image.h
+#if !defined(KOI_ALLOCATOR_DEFINED)
+#define KOI_ALLOCATOR_DEFINED
+typedef struct
+{
+   void *(*alloc_fn)   (void *user, size_t size);
+   void *(*realloc_fn) (void *user, void *p, size_t old_size, size_t new_size);
+   void  (*free_fn)    (void *user, void *p);
+   void  *user;
+} koi_allocator;
+#endif
+
+// use 'a' (copied) for all writes, NULL to go back to KOI_WRITE_MALLOC/KOI_WRITE_FREE
+KOIWDEF void koi_set_write_allocator(koi_allocator const *a);
+
 // flip the image vertically, so the first pixel in the saved array is the bottom left
 KOIWDEF void koi_set_flip_vertically_on_write(int flag_true_if_should_flip);
 // set qoi color space info, value is either 0 or 1
 #if !defined(KOI_WRITE_NO_QOI)
 KOIWDEF void koi_set_qoi_color_space_on_write(int qoi_color_space);
+// encode qoi images in independent stripes of this many rows, 0 (default) for one stream
+KOIWDEF void koi_set_qoi_stripe_rows_on_write(int rows_per_stripe);
+// 0 for the fastest encoding (runs and full colors only), 1 (default) for the smallest
+KOIWDEF void koi_set_qoi_effort_on_write(int effort);
 #endif
 
+// runs job(arg, i) for every i in [0, count), in parallel if it can, and returns
+// once all of them are done; koi uses it for work that splits into independent parts
+typedef void koi_write_dispatch_func(void *context, void (*job)(void *arg, int i), void *arg, int count);
+
+// hand parallel work to 'func' (NULL, the default, runs it on the calling thread)
+KOIWDEF void koi_set_write_dispatch(koi_write_dispatch_func *func, void *context);
+
 // as above, but only applies to images saved on the thread that calls the function
 // this function is only available if your compiler supports thread-local variables;
 // calling it will fail to link if your compiler doesn't
 KOIWDEF void koi_set_flip_vertically_on_write_thread(int flag_true_if_should_flip);
 #if !defined(KOI_WRITE_NO_QOI)
 KOIWDEF void koi_set_qoi_color_space_on_write_thread(int qoi_color_space);
+KOIWDEF void koi_set_qoi_stripe_rows_on_write_thread(int rows_per_stripe);
+KOIWDEF void koi_set_qoi_effort_on_write_thread(int effort);
+#endif
+KOIWDEF void koi_set_write_dispatch_thread(koi_write_dispatch_func *func, void *context);
+KOIWDEF void koi_set_write_allocator_thread(koi_allocator const *a);
+
+#if defined(KOI_WRITE_STATS)
+// what saves spent their work on, added up over every save until it is reset
+typedef struct
+{
+   // QOI chunks written of each kind; run_pixels / op_run is the average run
+   unsigned long op_rgb, op_rgba, op_index, op_diff, op_luma, op_run;
+   unsigned long run_pixels;
+   // calls to the write function, the bytes handed to it and the time in it
+   unsigned long io_calls;
+   size_t io_bytes;
+   double io_seconds;
+   size_t allocations, bytes_allocated;
+   // seconds by KOI_WRITE_STATS_CLOCK in the save calls, io_seconds included
+   double encode_seconds;
+} koi_write_stats;
+
+// add to '*stats' (not cleared) on every save from now on, NULL to stop
+KOIWDEF void koi_set_write_stats(koi_write_stats *stats);
+KOIWDEF void koi_set_write_stats_thread(koi_write_stats *stats);
 #endif
 
 #if defined(__cplusplus)
@@ -227,6 +466,7 @@ KOIWDEF void koi_set_qoi_color_space_on_write_thread(int qoi_color_space);
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h> // INT_MAX
 #include <math.h>
 
 #if !defined(KOI_WRITE_ASSERT)
@@ -234,6 +474,36 @@ KOIWDEF void koi_set_qoi_color_space_on_write_thread(int qoi_color_space);
    #define KOI_WRITE_ASSERT(x) assert(x)
 #endif
 
+#if defined(KOI_WRITE_MALLOC) && defined(KOI_WRITE_FREE)
+// ok
+#elif !defined(KOI_WRITE_MALLOC) && !defined(KOI_WRITE_FREE)
+// ok
+#else
+   #error "Must define all or none of KOI_WRITE_MALLOC and KOI_WRITE_FREE"
+#endif
+
+#if !defined(KOI_WRITE_MALLOC)
+   #define KOI_WRITE_MALLOC(sz)  malloc(sz)
+   #define KOI_WRITE_FREE(p)     free(p)
+#endif
+
+#if defined(KOI_WRITE_STATS) && !defined(KOI_WRITE_STATS_CLOCK)
+#include <time.h>
+   #define KOI_WRITE_STATS_CLOCK()  ((double)clock() / CLOCKS_PER_SEC)
+#endif
+
+// SSE2 is part of every x86-64 CPU and NEON of every AArch64 one, so there
+// is nothing to check for at run time
+#if !defined(KOI_WRITE_NO_SIMD)
+   #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+      #define KOIW_SSE2
+      #include <emmintrin.h>
+   #elif defined(__aarch64__) || defined(_M_ARM64)
+      #define KOIW_NEON
+      #include <arm_neon.h>
+   #endif
+#endif
+
 #if defined(__cplusplus)
    #define KOIW_EXTERN extern "C"
 #else
@@ -280,12 +550,31 @@ typedef uint32_t     koiw__uint32;
 // should produce compiler error if size is wrong
 typedef int koiw_validate_uint32[sizeof(koiw__uint32) == 4 ? 1 : -1];
 
+#if !defined(KOI_IO_BUFFER_SIZE)
+   #define KOI_IO_BUFFER_SIZE (32 * 1024)
+#endif
+
+// the QOI encoder needs room for at least one worst-case pixel
+typedef int koiw_validate_io_buffer_size[KOI_IO_BUFFER_SIZE >= 64 ? 1 : -1];
+
 typedef struct
 {
    koi_write_func *func;
    void *context;
-   koiw_uc buffer[64];
-   int buf_used;
+
+   // output is collected in 'buf', which is either 'buffer' or, when writing
+   // to memory, the caller's destination (and 'func' is NULL)
+   koiw_uc *buf;
+   int buf_size, buf_used;
+   int overflow;
+   size_t flushed; // bytes handed to 'func' so far
+   koiw_uc buffer[KOI_IO_BUFFER_SIZE];
+
+   // -1 to take them from the koi_set_*_on_write settings
+   int flip, qoi_color_space, qoi_stripe_rows, qoi_effort;
+#if defined(KOI_WRITE_STATS)
+   koi_write_stats *stats;
+#endif
 } koi__write_context;
 
 // initialize a callback-based context
@@ -293,6 +582,31 @@ static void koi__start_write_callbacks(koi__write_context *s, koi_write_func *c,
 {
    s->func = c;
    s->context = context;
+   s->buf = s->buffer;
+   s->buf_size = (int)sizeof(s->buffer);
+   s->buf_used = 0;
+   s->overflow = 0;
+   s->flushed = 0;
+   s->flip = s->qoi_color_space = s->qoi_stripe_rows = s->qoi_effort = -1;
+#if defined(KOI_WRITE_STATS)
+   s->stats = NULL;
+#endif
+}
+
+// initialize a context that writes straight into 'capacity' bytes at 'dst'
+static void koi__start_write_memory(koi__write_context *s, void *dst, int capacity)
+{
+   s->func = NULL;
+   s->context = NULL;
+   s->buf = (koiw_uc*)dst;
+   s->buf_size = capacity;
+   s->buf_used = 0;
+   s->overflow = 0;
+   s->flushed = 0;
+   s->flip = s->qoi_color_space = s->qoi_stripe_rows = s->qoi_effort = -1;
+#if defined(KOI_WRITE_STATS)
+   s->stats = NULL;
+#endif
 }
 
 static
@@ -338,14 +652,46 @@ KOIWDEF void koi_set_qoi_color_space_on_write(int qoi_color_space)
 {
    koi__qoi_color_space_on_write_global = qoi_color_space;
 }
+
+static int koi__qoi_stripe_rows_on_write_global = 0;
+
+KOIWDEF void koi_set_qoi_stripe_rows_on_write(int rows_per_stripe)
+{
+   koi__qoi_stripe_rows_on_write_global = rows_per_stripe;
+}
+
+static int koi__qoi_effort_on_write_global = 1;
+
+KOIWDEF void koi_set_qoi_effort_on_write(int effort)
+{
+   koi__qoi_effort_on_write_global = effort > 0 ? 1 : 0;
+}
 #endif
 
+typedef struct
+{
+   koi_write_dispatch_func *func;
+   void *context;
+} koiw__dispatch;
+
+static koiw__dispatch koiw__dispatch_global = { NULL, NULL };
+
+KOIWDEF void koi_set_write_dispatch(koi_write_dispatch_func *func, void *context)
+{
+   koiw__dispatch_global.func = func;
+   koiw__dispatch_global.context = context;
+}
+
 #if !defined(KOI_WRITE_THREAD_LOCAL)
    #define koi__vertically_flip_on_write koi__vertically_flip_on_write_global
 
    #if !defined(KOI_WRITE_NO_QOI)
       #define koi__qoi_color_space_on_write koi__qoi_color_space_on_write_global
+      #define koi__qoi_stripe_rows_on_write koi__qoi_stripe_rows_on_write_global
+      #define koi__qoi_effort_on_write koi__qoi_effort_on_write_global
    #endif
+
+   #define koiw__dispatch_current koiw__dispatch_global
 #else
 static KOI_WRITE_THREAD_LOCAL int koi__vertically_flip_on_write_local, koi__vertically_flip_on_write_set;
 
@@ -371,9 +717,152 @@ KOIWDEF void koi_set_qoi_color_space_on_write_thread(int qoi_color_space)
       #define koi__qoi_color_space_on_write (koi__qoi_color_space_on_write_set    \
                                             ? koi__qoi_color_space_on_write_local \
                                             : koi__qoi_color_space_on_write_global)
+
+static KOI_WRITE_THREAD_LOCAL int koi__qoi_stripe_rows_on_write_local, koi__qoi_stripe_rows_on_write_set;
+
+KOIWDEF void koi_set_qoi_stripe_rows_on_write_thread(int rows_per_stripe)
+{
+   koi__qoi_stripe_rows_on_write_local = rows_per_stripe;
+   koi__qoi_stripe_rows_on_write_set = 1;
+}
+
+      #define koi__qoi_stripe_rows_on_write (koi__qoi_stripe_rows_on_write_set    \
+                                            ? koi__qoi_stripe_rows_on_write_local \
+                                            : koi__qoi_stripe_rows_on_write_global)
+
+static KOI_WRITE_THREAD_LOCAL int koi__qoi_effort_on_write_local, koi__qoi_effort_on_write_set;
+
+KOIWDEF void koi_set_qoi_effort_on_write_thread(int effort)
+{
+   koi__qoi_effort_on_write_local = effort > 0 ? 1 : 0;
+   koi__qoi_effort_on_write_set = 1;
+}
+
+      #define koi__qoi_effort_on_write (koi__qoi_effort_on_write_set    \
+                                       ? koi__qoi_effort_on_write_local \
+                                       : koi__qoi_effort_on_write_global)
    #endif // !KOI_WRITE_NO_QOI
+
+static KOI_WRITE_THREAD_LOCAL koiw__dispatch koiw__dispatch_local;
+static KOI_WRITE_THREAD_LOCAL int koiw__dispatch_set;
+
+KOIWDEF void koi_set_write_dispatch_thread(koi_write_dispatch_func *func, void *context)
+{
+   koiw__dispatch_local.func = func;
+   koiw__dispatch_local.context = context;
+   koiw__dispatch_set = 1;
+}
+
+   #define koiw__dispatch_current (koiw__dispatch_set ? koiw__dispatch_local : koiw__dispatch_global)
+#endif // KOI_WRITE_THREAD_LOCAL
+
+#if defined(KOI_WRITE_STATS)
+static koi_write_stats *koiw__stats_global;
+
+KOIWDEF void koi_set_write_stats(koi_write_stats *stats)
+{
+   koiw__stats_global = stats;
+}
+
+#if !defined(KOI_WRITE_THREAD_LOCAL)
+   #define koiw__stats_current koiw__stats_global
+#else
+static KOI_WRITE_THREAD_LOCAL koi_write_stats *koiw__stats_local;
+static KOI_WRITE_THREAD_LOCAL int koiw__stats_set;
+
+KOIWDEF void koi_set_write_stats_thread(koi_write_stats *stats)
+{
+   koiw__stats_local = stats;
+   koiw__stats_set = 1;
+}
+
+   #define koiw__stats_current (koiw__stats_set ? koiw__stats_local : koiw__stats_global)
 #endif // KOI_WRITE_THREAD_LOCAL
 
+// 'st' may be NULL
+   #define KOIW__STATS_ADD(st, field, n)  do { if (st) (st)->field += (n); } while (0)
+   #define KOIW__STATS_TIME(st, field, stmt)                                           \
+      do {                                                                          \
+         double koiw__t0 = KOI_WRITE_STATS_CLOCK();                                 \
+         stmt;                                                                      \
+         KOIW__STATS_ADD(st, field, KOI_WRITE_STATS_CLOCK() - koiw__t0);            \
+      } while (0)
+#else
+   #define KOIW__STATS_ADD(st, field, n)      ((void)0)
+   #define KOIW__STATS_TIME(st, field, stmt)  stmt
+#endif // KOI_WRITE_STATS
+
+// look the settings up once, everything after this goes by the context
+static void koiw__resolve_settings(koi__write_context *s)
+{
+   if (s->flip < 0)
+      s->flip = koi__vertically_flip_on_write;
+#if !defined(KOI_WRITE_NO_QOI)
+   if (s->qoi_color_space < 0)
+      s->qoi_color_space = koi__qoi_color_space_on_write;
+   if (s->qoi_stripe_rows < 0)
+      s->qoi_stripe_rows = koi__qoi_stripe_rows_on_write;
+   if (s->qoi_effort < 0)
+      s->qoi_effort = koi__qoi_effort_on_write;
+#endif
+#if defined(KOI_WRITE_STATS)
+   s->stats = koiw__stats_current;
+#endif
+}
+
+static koi_allocator koiw__allocator_global;
+static int koiw__allocator_global_set;
+
+KOIWDEF void koi_set_write_allocator(koi_allocator const *a)
+{
+   koiw__allocator_global_set = (a != NULL);
+   if (a) koiw__allocator_global = *a;
+}
+
+#if defined(KOI_WRITE_THREAD_LOCAL)
+static KOI_WRITE_THREAD_LOCAL koi_allocator koiw__allocator_local;
+static KOI_WRITE_THREAD_LOCAL int koiw__allocator_local_set, koiw__allocator_set;
+
+KOIWDEF void koi_set_write_allocator_thread(koi_allocator const *a)
+{
+   koiw__allocator_local_set = (a != NULL);
+   koiw__allocator_set = 1;
+   if (a) koiw__allocator_local = *a;
+}
+#endif
+
+// the allocator writes on this thread use, NULL for KOI_WRITE_MALLOC/KOI_WRITE_FREE
+static koi_allocator const *koiw__allocator(void)
+{
+#if defined(KOI_WRITE_THREAD_LOCAL)
+   if (koiw__allocator_set)
+      return koiw__allocator_local_set ? &koiw__allocator_local : NULL;
+#endif
+   return koiw__allocator_global_set ? &koiw__allocator_global : NULL;
+}
+
+static void *koiw__malloc(size_t size)
+{
+   koi_allocator const *a = koiw__allocator();
+#if defined(KOI_WRITE_STATS)
+   koi_write_stats *st = koiw__stats_current;
+   KOIW__STATS_ADD(st, allocations, 1);
+   KOIW__STATS_ADD(st, bytes_allocated, size);
+#endif
+   return a ? a->alloc_fn(a->user, size) : KOI_WRITE_MALLOC(size);
+}
+
+static void koiw__free(void *p)
+{
+   koi_allocator const *a = koiw__allocator();
+   if (p == NULL)
+      return;
+   if (a)
+      a->free_fn(a->user, p);
+   else
+      KOI_WRITE_FREE(p);
+}
+
 #if !defined(KOI_WRITE_NO_STDIO)
 static void koi__stdio_write(void *context, void *data, int size)
 {
@@ -434,45 +923,85 @@ static void koi__end_write_file(koi__write_context *s)
 
 #endif // !KOI_WRITE_NO_STDIO
 
+static void koiw__write_flush(koi__write_context *s)
+{
+   // when writing to memory the bytes are already where they belong
+   if (s->func && s->buf_used) {
+      KOIW__STATS_TIME(s->stats, io_seconds, s->func(s->context, s->buf, s->buf_used));
+      KOIW__STATS_ADD(s->stats, io_calls, 1);
+      KOIW__STATS_ADD(s->stats, io_bytes, (size_t)s->buf_used);
+      s->flushed += s->buf_used;
+      s->buf_used = 0;
+   }
+}
+
+static void koiw__write1(koi__write_context *s, koiw_uc a)
+{
+   if (s->buf_used + 1 > s->buf_size) {
+      koiw__write_flush(s);
+      if (s->buf_used + 1 > s->buf_size) {
+         // out of room in a memory destination
+         s->overflow = 1;
+         return;
+      }
+   }
+   s->buf[s->buf_used++] = a;
+}
+
+static void koiw__write(koi__write_context *s, const koiw_uc *data, size_t n)
+{
+   size_t room;
+   while (n > 0) {
+      if (s->buf_used == s->buf_size) {
+         koiw__write_flush(s);
+         if (s->buf_used == s->buf_size) {
+            s->overflow = 1;
+            return;
+         }
+      }
+      room = (size_t)(s->buf_size - s->buf_used);
+      if (room > n)
+         room = n;
+      memcpy(s->buf + s->buf_used, data, room);
+      s->buf_used += (int)room;
+      data += room;
+      n -= room;
+   }
+}
+
+// the put functions go through the buffer as well, so a header costs no
+// extra calls to the write function; koiw__write_flush when you are done
 koiw_inline static void koiw__put8(koi__write_context *s, koiw_uc c)
 {
-   s->func(s->context, &c, 1);
+   koiw__write1(s, c);
 }
 
 static void koiw__put16le(koi__write_context *s, int x)
 {
-   koiw_uc b[2];
-   b[0] = KOIW_UCHAR(x);
-   b[1] = KOIW_UCHAR(x >> 8);
-   s->func(s->context, b, 2);
+   koiw__write1(s, KOIW_UCHAR(x));
+   koiw__write1(s, KOIW_UCHAR(x >> 8));
 }
 
 static void koiw__put16be(koi__write_context *s, int x)
 {
-   koiw_uc b[2];
-   b[0] = KOIW_UCHAR(x >> 8);
-   b[1] = KOIW_UCHAR(x);
-   s->func(s->context, b, 2);
+   koiw__write1(s, KOIW_UCHAR(x >> 8));
+   koiw__write1(s, KOIW_UCHAR(x));
 }
 
 static void koiw__put32le(koi__write_context *s, koiw__uint32 x)
 {
-   koiw_uc b[4];
-   b[0] = KOIW_UCHAR(x);
-   b[1] = KOIW_UCHAR(x >> 8);
-   b[2] = KOIW_UCHAR(x >> 16);
-   b[3] = KOIW_UCHAR(x >> 24);
-   s->func(s->context, b, 4);
+   koiw__write1(s, KOIW_UCHAR(x));
+   koiw__write1(s, KOIW_UCHAR(x >> 8));
+   koiw__write1(s, KOIW_UCHAR(x >> 16));
+   koiw__write1(s, KOIW_UCHAR(x >> 24));
 }
 
 static void koiw__put32be(koi__write_context *s, koiw__uint32 x)
 {
-   koiw_uc b[4];
-   b[0] = KOIW_UCHAR(x >> 24);
-   b[1] = KOIW_UCHAR(x >> 16);
-   b[2] = KOIW_UCHAR(x >> 8);
-   b[3] = KOIW_UCHAR(x);
-   s->func(s->context, b, 4);
+   koiw__write1(s, KOIW_UCHAR(x >> 24));
+   koiw__write1(s, KOIW_UCHAR(x >> 16));
+   koiw__write1(s, KOIW_UCHAR(x >> 8));
+   koiw__write1(s, KOIW_UCHAR(x));
 }
 
 static void koiw__writefv(koi__write_context *s, int big_endian, const char *fmt, va_list v)
@@ -520,234 +1049,848 @@ static void koiw__writef(koi__write_context *s, int big_endian, const char *fmt,
    va_end(v);
 }
 
-static void koiw__write_flush(koi__write_context *s)
+//////////////////////////////////////////////////////////////////////////////
+//
+//  QOI - The "Quite OK Image Format" decoder
+//
+#if !defined(KOI_WRITE_NO_QOI)
+
+typedef union {
+   koiw_uc color[4];
+   koiw__uint32 v;
+} koiw__qoi_pixel;
+
+// worst case output of a single pixel, a QOI_OP_RGBA chunk
+#define KOIW__QOI_MAX_OP 5
+
+#define KOIW__QOI_COLOR_HASH(px) ((px).color[0] * 3 + (px).color[1] * 5 + (px).color[2] * 7 + (px).color[3] * 11)
+
+// expand the components of one input pixel to RGBA
+#define KOIW__QOI_READ_1(px, d)  (px).color[0] = (px).color[1] = (px).color[2] = (d)[0], (px).color[3] = 255
+#define KOIW__QOI_READ_2(px, d)  (px).color[0] = (px).color[1] = (px).color[2] = (d)[0], (px).color[3] = (d)[1]
+#define KOIW__QOI_READ_3(px, d)  (px).color[0] = (d)[0], (px).color[1] = (d)[1], (px).color[2] = (d)[2], (px).color[3] = 255
+#define KOIW__QOI_READ_4(px, d)  memcpy((px).color, (d), 4)
+
+// how many of the 'w' n-byte pixels at 'd' are the same as the first one.
+// a run compares 16 input bytes at a time against the first pixel repeated;
+// a step that is a multiple of 'n' keeps every load lined up with it
+static koiw_inline int koiw__qoi_run_length(const koiw_uc *d, int n, int w)
 {
-   if (s->buf_used) {
-      s->func(s->context, &s->buffer, s->buf_used);
-      s->buf_used = 0;
+   int i = 1;
+#if defined(KOIW_SSE2) || defined(KOIW_NEON)
+   int k, bytes = n * w, step = 16 - 16 % n;
+   koiw_uc pattern[16];
+   if (bytes >= n + 16) {
+      for (k = 0; k < 16; ++k)
+         pattern[k] = d[k % n];
+      {
+   #if defined(KOIW_SSE2)
+         __m128i p = _mm_loadu_si128((const __m128i*)pattern);
+         for (k = n; k + 16 <= bytes; k += step)
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(d + k)), p)) != 0xffff)
+               break;
+   #else
+         uint8x16_t p = vld1q_u8(pattern);
+         for (k = n; k + 16 <= bytes; k += step)
+            if (vminvq_u8(vceqq_u8(vld1q_u8(d + k), p)) != 0xff)
+               break;
+   #endif
+      }
+      i = k / n; // the pixels up to the chunk that differs all matched
    }
+#endif
+   for (d += (size_t)i * n; i < w && memcmp(d, d - (size_t)i * n, n) == 0; ++i, d += n)
+      ;
+   return i;
 }
 
-static void koiw__write1(koi__write_context *s, koiw_uc a)
-{
-   if ((size_t)s->buf_used + 1 > sizeof(s->buffer))
-      koiw__write_flush(s);
-   s->buffer[s->buf_used++] = a;
+// koiw__qoi_encode_row_N encodes 'w' pixels with N components from 'd' into
+// 'o', which must have room for KOIW__QOI_MAX_OP * w + 1 bytes, and returns
+// the new end of the output. '*run' carries an unfinished QOI_OP_RUN over to
+// the next call. there is one of these per input layout; images without
+// alpha never change it, so they skip straight to the DIFF/LUMA/RGB choice.
+// the koiw__qoi_encode_row_fast_N ones (effort 0) only look for runs and
+// write everything else as QOI_OP_RGB/QOI_OP_RGBA, so the index isn't kept
+#define KOIW__QOI_ENCODE_ROW(name, n, has_alpha, all_ops)                                         \
+static koiw_uc *name(koiw_uc *o, const koiw_uc *d, int w, koiw__qoi_pixel *index, koiw__qoi_pixel *prev, int *run) \
+{                                                                                                 \
+   koiw__qoi_pixel px, pv = *prev;                                                                \
+   int r = *run, h, vr, vg, vb;                                                                   \
+   koiw_sc dr, dg, db, dr_dg, db_dg;                                                              \
+                                                                                                  \
+   for (; w; --w, d += n) {                                                                       \
+      KOIW__QOI_READ_##n(px, d);                                                                  \
+      if (px.v == pv.v) {                                                                         \
+         /* take the whole run at once, full QOI_OP_RUNs of 62 go out in bulk */                  \
+         h = koiw__qoi_run_length(d, n, w);                                                       \
+         r += h;                                                                                  \
+         if (r >= 62) {                                                                           \
+            memset(o, 0xc0 | (62 - 1), r / 62); /* QOI_OP_RUN */                                  \
+            o += r / 62;                                                                          \
+            r %= 62;                                                                              \
+         }                                                                                        \
+         d += (size_t)(h - 1) * n;                                                                \
+         w -= h - 1;                                                                              \
+         continue;                                                                                \
+      }                                                                                           \
+      if (r > 0) {                                                                                \
+         *o++ = KOIW_UCHAR(0xc0 | (r - 1)); /* QOI_OP_RUN */                                      \
+         r = 0;                                                                                   \
+      }                                                                                           \
+                                                                                                  \
+      h = KOIW__QOI_COLOR_HASH(px) & (64 - 1);                                                    \
+      if ((all_ops) && index[h].v == px.v) {                                                      \
+         *o++ = KOIW_UCHAR(h); /* QOI_OP_INDEX */                                                 \
+      }                                                                                           \
+      else if (!(has_alpha) || px.color[3] == pv.color[3]) {                                      \
+         if (all_ops)                                                                             \
+            index[h] = px;                                                                        \
+         dr = (koiw_sc)(px.color[0] - pv.color[0]);                                               \
+         dg = (koiw_sc)(px.color[1] - pv.color[1]);                                               \
+         db = (koiw_sc)(px.color[2] - pv.color[2]);                                               \
+         dr_dg = (koiw_sc)(dr - dg);                                                              \
+         db_dg = (koiw_sc)(db - dg);                                                              \
+         vr = dr + 2;                                                                             \
+         vg = dg + 2;                                                                             \
+         vb = db + 2;                                                                             \
+         /* each bias is in range exactly when it is a small non-negative value,  */              \
+         /* so or-ing them checks all three at once                               */              \
+         if ((all_ops) && (unsigned)(vr | vg | vb) < 4) {                                         \
+            *o++ = KOIW_UCHAR(0x40 | vr << 4 | vg << 2 | vb); /* QOI_OP_DIFF */                   \
+         }                                                                                        \
+         else if ((all_ops) && (unsigned)(dg + 32) < 64 && (unsigned)((dr_dg + 8) | (db_dg + 8)) < 16) { \
+            o[0] = KOIW_UCHAR(0x80 | (dg + 32)); /* QOI_OP_LUMA */                                \
+            o[1] = KOIW_UCHAR((dr_dg + 8) << 4 | (db_dg + 8));                                    \
+            o += 2;                                                                               \
+         }                                                                                        \
+         else {                                                                                   \
+            o[0] = 0xfe; /* QOI_OP_RGB */                                                         \
+            o[1] = px.color[0];                                                                   \
+            o[2] = px.color[1];                                                                   \
+            o[3] = px.color[2];                                                                   \
+            o += 4;                                                                               \
+         }                                                                                        \
+      }                                                                                           \
+      else {                                                                                      \
+         if (all_ops)                                                                             \
+            index[h] = px;                                                                        \
+         o[0] = 0xff; /* QOI_OP_RGBA */                                                           \
+         o[1] = px.color[0];                                                                      \
+         o[2] = px.color[1];                                                                      \
+         o[3] = px.color[2];                                                                      \
+         o[4] = px.color[3];                                                                      \
+         o += 5;                                                                                  \
+      }                                                                                           \
+      pv = px;                                                                                    \
+   }                                                                                              \
+                                                                                                  \
+   *prev = pv;                                                                                    \
+   *run = r;                                                                                      \
+   return o;                                                                                      \
 }
 
-static void koiw__write3(koi__write_context *s, koiw_uc a, koiw_uc b, koiw_uc c)
-{
-   int n;
-   if ((size_t)s->buf_used + 3 > sizeof(s->buffer))
-      koiw__write_flush(s);
-   n = s->buf_used;
-   s->buf_used = n + 3;
-   s->buffer[n + 0] = a;
-   s->buffer[n + 1] = b;
-   s->buffer[n + 2] = c;
-}
+#if defined(KOI_WRITE_ONLY_GREY8) || defined(KOI_WRITE_ONLY_GREY_ALPHA8) || defined(KOI_WRITE_ONLY_RGB8) || defined(KOI_WRITE_ONLY_RGBA8)
+   #define KOIW__QOI_ONLY_LAYOUTS
+#endif
 
-static void koiw__write_pixel(koi__write_context *s, int rgb_dir, int comp, int write_alpha, int expand_mono, koiw_uc *d)
+#if !defined(KOIW__QOI_ONLY_LAYOUTS) || defined(KOI_WRITE_ONLY_GREY8)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_1, 1, 0, 1)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_fast_1, 1, 0, 0)
+#else
+   #define koiw__qoi_encode_row_1 NULL
+   #define koiw__qoi_encode_row_fast_1 NULL
+#endif
+#if !defined(KOIW__QOI_ONLY_LAYOUTS) || defined(KOI_WRITE_ONLY_GREY_ALPHA8)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_2, 2, 1, 1)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_fast_2, 2, 1, 0)
+#else
+   #define koiw__qoi_encode_row_2 NULL
+   #define koiw__qoi_encode_row_fast_2 NULL
+#endif
+#if !defined(KOIW__QOI_ONLY_LAYOUTS) || defined(KOI_WRITE_ONLY_RGB8)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_3, 3, 0, 1)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_fast_3, 3, 0, 0)
+#else
+   #define koiw__qoi_encode_row_3 NULL
+   #define koiw__qoi_encode_row_fast_3 NULL
+#endif
+#if !defined(KOIW__QOI_ONLY_LAYOUTS) || defined(KOI_WRITE_ONLY_RGBA8)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_4, 4, 1, 1)
+KOIW__QOI_ENCODE_ROW(koiw__qoi_encode_row_fast_4, 4, 1, 0)
+#else
+   #define koiw__qoi_encode_row_4 NULL
+   #define koiw__qoi_encode_row_fast_4 NULL
+#endif
+
+#undef KOIW__QOI_ENCODE_ROW
+
+// prepare 'index' and 'prev' for the first pixel of a stripe, so that it is
+// encoded the same whatever a decoder saw before: no index slot holds a pixel
+// that hashes to it, and 'prev' is far enough from the pixel that it goes
+// out as a full QOI_OP_RGB(A). QOI_OP_RGB keeps the alpha of the previous
+// pixel, which for an image without alpha is always 255
+static void koiw__qoi_stripe_start(koiw__qoi_pixel *index, koiw__qoi_pixel *prev, const koiw_uc *d, int comp)
 {
-   koiw_uc bg[3] = { 255, 0, 255 }, px[3];
-   int k;
-   
-   if (write_alpha < 0)
-      koiw__write1(s, d[comp - 1]);
-   
+   memset(index, 0, 64 * sizeof(*index)); // all zero hashes to slot 0...
+   index[0].color[0] = 1;                 // ...and this one to slot 3
    switch (comp) {
-      case 2: // 2 pixels = mono + alpha, alpha is written separately, so same as 1-channel case
-      case 1: {
-         if (expand_mono)
-            koiw__write3(s, d[0], d[0], d[0]);  // monochrome bmp
-         else
-            koiw__write1(s, d[0]);              // monochrome TGA
-         break;
-      }
-      case 4: {
-         if (!write_alpha) {
-            // composite against pink background
-            for (k = 0; k < 3; ++k)
-               px[k] = bg[k] + ((d[k] - bg[k]) * d[3]) / 255;
-            koiw__write3(s, px[1 - rgb_dir], px[1], px[1 + rgb_dir]);
-            break;
-         }
-      }
-      /* FALLTHROUGH */
-      case 3: {
-         koiw__write3(s, d[1 - rgb_dir], d[1], d[1 + rgb_dir]);
-         break;
-      }
+      case 1: KOIW__QOI_READ_1(*prev, d); break;
+      case 2: KOIW__QOI_READ_2(*prev, d); break;
+      case 3: KOIW__QOI_READ_3(*prev, d); break;
+      default: KOIW__QOI_READ_4(*prev, d); break;
    }
-   if (write_alpha > 0)
-      koiw__write1(s, d[comp - 1]);
+   prev->color[0] ^= 0x80;
+   prev->color[3] ^= 0x80;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-//
-//  QOI - The "Quite OK Image Format" decoder
-//
-#if !defined(KOI_WRITE_NO_QOI)
+#undef KOIW__QOI_READ_1
+#undef KOIW__QOI_READ_2
+#undef KOIW__QOI_READ_3
+#undef KOIW__QOI_READ_4
+#undef KOIW__QOI_COLOR_HASH
 
-typedef union {
-   koiw_uc color[4];
-   koiw__uint32 v;
-} koiw__qoi_pixel;
+typedef koiw_uc *koiw__qoi_encode_row_func(koiw_uc *o, const koiw_uc *d, int w, koiw__qoi_pixel *index, koiw__qoi_pixel *prev, int *run);
 
-static koiw__qoi_pixel koi_read_qoi_pixel(int comp, int has_alpha, koiw_uc *d)
+// indexed by [effort 0 or more][components - 1]
+static koiw__qoi_encode_row_func *const koiw__qoi_encode_row[2][4] =
 {
-   koiw__qoi_pixel out;
-   koiw_uc bg[3] = { 255, 0, 255 }, px[3];
-   int k;
-   
-   switch (comp) {
-      case 2: // 2 pixels = mono + alpha, alpha is read separately, so same as 1-channel case
-      case 1: {
-         out.color[0] = out.color[1] = out.color[2] = d[0];
-         break;
+   { koiw__qoi_encode_row_fast_1, koiw__qoi_encode_row_fast_2, koiw__qoi_encode_row_fast_3, koiw__qoi_encode_row_fast_4 },
+   { koiw__qoi_encode_row_1,      koiw__qoi_encode_row_2,      koiw__qoi_encode_row_3,      koiw__qoi_encode_row_4      }
+};
+
+#if defined(KOIW__QOI_ONLY_LAYOUTS)
+   #undef koiw__qoi_encode_row_1
+   #undef koiw__qoi_encode_row_2
+   #undef koiw__qoi_encode_row_3
+   #undef koiw__qoi_encode_row_4
+   #undef koiw__qoi_encode_row_fast_1
+   #undef koiw__qoi_encode_row_fast_2
+   #undef koiw__qoi_encode_row_fast_3
+   #undef koiw__qoi_encode_row_fast_4
+#endif
+
+#if defined(KOI_WRITE_STATS)
+// count the chunks in 'p' to 'end', which starts and ends on chunk boundaries;
+// done on the output afterwards, so the row encoders are left alone
+static void koiw__qoi_count_ops(koi_write_stats *st, const koiw_uc *p, const koiw_uc *end)
+{
+   if (st == NULL)
+      return;
+   while (p < end) {
+      if (*p == 0xfe) {
+         ++st->op_rgb;
+         p += 4;
       }
-      case 4: {
-         if (!has_alpha) {
-            // composite against pink background
-            for (k = 0; k < 3; ++k)
-               px[k] = bg[k] + ((d[k] - bg[k]) * d[3]) / 255;
-            
-            out.color[0] = px[0];
-            out.color[1] = px[1];
-            out.color[2] = px[2];
-            break;
-         }
+      else if (*p == 0xff) {
+         ++st->op_rgba;
+         p += 5;
       }
-      /* FALLTHROUGH */
-      case 3: {
-         out.color[0] = d[0];
-         out.color[1] = d[1];
-         out.color[2] = d[2];
-         break;
+      else switch (*p & 0xc0) {
+         case 0x00: ++st->op_index; ++p; break;
+         case 0x40: ++st->op_diff; ++p; break;
+         case 0x80: ++st->op_luma; p += 2; break;
+         default: ++st->op_run; st->run_pixels += (*p & 0x3f) + 1; ++p; break;
       }
    }
-   if (has_alpha != 0)
-      out.color[3] = d[comp - 1];
-   else
-      out.color[3] = 255;
-   
-   return out;
 }
+#else
+   #define koiw__qoi_count_ops(st, p, end)  ((void)0)
+#endif
 
-static int koi_write_qoi_core(koi__write_context *s, int x, int y, int comp, const void *data)
+// everything the encoder carries from one row to the next
+typedef struct
+{
+   int x, y, comp, rows_done;
+   int run;
+   koiw__qoi_pixel prev_px, index[64];
+   koiw__qoi_encode_row_func *encode_row;
+} koiw__qoi_state;
+
+static int koiw__qoi_check(int x, int y, int comp)
 {
-   int has_alpha = (comp == 2 || comp == 4);
-   int i, j, jstart, jdir, index_pos;
-   koiw__uint32 pxi, len;
-   koiw_uc run = 0;
-   koiw__qoi_pixel px, prev_px, index[64];
-   
    if (y < 0 || x < 0)
       return koiw__err("bad dimmensions", "Corrupt image dimmensions");
-   
-   koiw__writef(s, 1, "1111 44 11", 'q', 'o', 'i', 'f', x, y, has_alpha ? 4 : 3, koi__qoi_color_space_on_write != 0 ? 1 : 0);
-   
-   prev_px.color[0] = 0;   // R
-   prev_px.color[1] = 0;   // G
-   prev_px.color[2] = 0;   // B
-   prev_px.color[3] = 255; // A
-   px = prev_px;
+   if (comp < 1 || comp > 4)
+      return koiw__err("bad comp", "Number of components must be 1 to 4");
+   if (koiw__qoi_encode_row[1][comp - 1] == NULL)
+      return koiw__err("unsupported comp", "Number of components left out by KOI_WRITE_ONLY_*");
+   return 1;
+}
 
-   memset(index, 0, sizeof(index));
+// the state a QOI stream starts from
+static void koiw__qoi_reset(koiw__qoi_state *q)
+{
+   q->run = 0;
+   q->prev_px.color[0] = 0;   // R
+   q->prev_px.color[1] = 0;   // G
+   q->prev_px.color[2] = 0;   // B
+   q->prev_px.color[3] = 255; // A
+   memset(q->index, 0, sizeof(q->index));
+}
 
-#define KOIW_QOI_COLOR_HASH(px) (px.color[0] * 3 + px.color[1] * 5 + px.color[2] * 7 + px.color[3] * 11)
-   
-   if (koi__vertically_flip_on_write) {
-      jstart = y - 1;
-      jdir = -1;
-   }
-   else {
-      jstart = 0;
-      jdir = 1;
-   }
-   len = x * y;
-   for (pxi = 0; pxi < len; ++pxi) {
-      j = jstart + (pxi / x) * jdir;
-      i = pxi % x;
-      
-      koiw_uc *row = (koiw_uc*)data + j * x * comp;
-      koiw_uc *begin = row + i * comp;
-      
-      px = koi_read_qoi_pixel(comp, has_alpha, begin);
-      
-      if (px.v == prev_px.v) {
-         if (++run == 62 || pxi == len - 1) {
-            koiw__write1(s, (koiw_uc)(KOIW_UCHAR(0xc0) | (run - 1))); /* QOI_OP_RUN */
-            run = 0;
-         }
-      }
-      else {
-         if (run > 0) {
-            koiw__write1(s, (koiw_uc)(KOIW_UCHAR(0xc0) | (run - 1))); /* QOI_OP_RUN */
-            run = 0;
+// check the image description and write the header
+static int koiw__qoi_begin(koi__write_context *s, koiw__qoi_state *q, int x, int y, int comp)
+{
+   int has_alpha = (comp == 2 || comp == 4);
+
+   if (!koiw__qoi_check(x, y, comp))
+      return 0;
+
+   koiw__writef(s, 1, "1111 44 11", 'q', 'o', 'i', 'f', x, y, has_alpha ? 4 : 3, s->qoi_color_space != 0 ? 1 : 0);
+
+   q->x = x;
+   q->y = y;
+   q->comp = comp;
+   q->rows_done = 0;
+   koiw__qoi_reset(q);
+   q->encode_row = koiw__qoi_encode_row[s->qoi_effort > 0][comp - 1];
+   return 1;
+}
+
+// encode the next 'nrows' rows, 'stride' bytes apart (already resolved)
+static int koiw__qoi_encode_rows(koi__write_context *s, koiw__qoi_state *q, const koiw_uc *data, int nrows, int stride)
+{
+   int j, left, n;
+   const koiw_uc *d;
+   koiw_uc *o, tmp[KOIW__QOI_MAX_OP + 1];
+
+   // rows are encoded straight into the write buffer, in chunks small enough
+   // that even the worst case output of every pixel fits in the free space
+   for (j = 0; j < nrows; ++j) {
+      d = data + (size_t)j * stride;
+      for (left = q->x; left > 0; left -= n, d += (size_t)n * q->comp) {
+         n = (s->buf_size - s->buf_used - 1) / KOIW__QOI_MAX_OP;
+         if (n < left && n < 64) {
+            koiw__write_flush(s);
+            n = (s->buf_size - s->buf_used - 1) / KOIW__QOI_MAX_OP;
          }
-         
-         index_pos = KOIW_QOI_COLOR_HASH(px) & (64 - 1);
-         if (index[index_pos].v == px.v) {
-            koiw__write1(s, KOIW_UCHAR(index_pos)); /* QOI_OP_INDEX */
+         if (n > left)
+            n = left;
+         if (n > 0) {
+            o = q->encode_row(s->buf + s->buf_used, d, n, q->index, &q->prev_px, &q->run);
+            koiw__qoi_count_ops(s->stats, s->buf + s->buf_used, o);
+            s->buf_used = (int)(o - s->buf);
          }
          else {
-            index[index_pos] = px;
-            int ch;
-            koiw_uc header;
-            if (px.color[3] == prev_px.color[3]) {
-               koiw_sc dr = px.color[0] - prev_px.color[0];
-               koiw_sc dg = px.color[1] - prev_px.color[1];
-               koiw_sc db = px.color[2] - prev_px.color[2];
-               
-               if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) { /* QOI_OP_DIFF */
-                  header = KOIW_UCHAR(0x40) | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
-                  ch = 0;
-               }
-               else {
-                  koiw_sc dr_dg = dr - dg;
-                  koiw_sc db_dg = db - dg;
-                  
-                  if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) { /* QOI_OP_LUMA */
-                     koiw__write1(s, KOIW_UCHAR(0x80) | (dg + 32));
-                     header = (dr_dg + 8) << 4 | (db_dg + 8);
-                     ch = 0;
-                  }
-                  else {
-                     header = KOIW_UCHAR(0xfe); /* QOI_OP_RGB */
-                     ch = 3;
-                  }
-               }
-            }
-            else {
-               header = KOIW_UCHAR(0xff); /* QOI_OP_RGBA */
-               ch = 4;
-            }
-            koiw__write1(s, header);
-            koiw__write_pixel(s, 1, ch, ch == 4, 1, px.color);
+            // a memory destination smaller than the worst case may still be
+            // big enough, so go on a pixel at a time until it really is full
+            n = (int)(q->encode_row(tmp, d, 1, q->index, &q->prev_px, &q->run) - tmp);
+            if (n > s->buf_size - s->buf_used)
+               return koiw__err("buffer too small", "Output buffer too small for image");
+            koiw__qoi_count_ops(s->stats, tmp, tmp + n);
+            memcpy(s->buf + s->buf_used, tmp, n);
+            s->buf_used += n;
+            n = 1;
          }
       }
-      prev_px = px;
    }
+   q->rows_done += nrows;
+   return 1;
+}
+
+static void koiw__qoi_flush_run(koi__write_context *s, koiw__qoi_state *q)
+{
+   if (q->run > 0) {
+      KOIW__STATS_ADD(s->stats, op_run, 1);
+      KOIW__STATS_ADD(s->stats, run_pixels, (unsigned long)q->run);
+      koiw__write1(s, KOIW_UCHAR(0xc0 | (q->run - 1))); /* QOI_OP_RUN */
+      q->run = 0;
+   }
+}
+
+// finish a pending run and write the end marker
+static int koiw__qoi_end(koi__write_context *s, koiw__qoi_state *q)
+{
+   koiw__qoi_flush_run(s, q);
+
+   koiw__writef(s, 1, "11111111", 0, 0, 0, 0, 0, 0, 0, 1);
+   if (s->overflow)
+      return koiw__err("buffer too small", "Output buffer too small for image");
    koiw__write_flush(s);
+   return 1;
+}
+
+// one image split into stripes that are encoded independently, each into
+// its own worst-case sized part of 'out'
+typedef struct
+{
+   const koiw_uc *data;
+   int x, y, comp, stride, flip, stripe_rows;
+   koiw__qoi_encode_row_func *encode_row;
+   size_t stripe_cap;
+   koiw_uc *out;
+   size_t *len;
+} koiw__qoi_stripes;
+
+static void koiw__qoi_encode_stripe(void *arg, int i)
+{
+   koiw__qoi_stripes *t = (koiw__qoi_stripes*)arg;
+   koiw__qoi_encode_row_func *encode_row = t->encode_row;
+   koiw__qoi_pixel prev, index[64];
+   koiw_uc *o = t->out + (size_t)i * t->stripe_cap;
+   const koiw_uc *d;
+   int j, j_end, run = 0;
+
+   j = i * t->stripe_rows;
+   j_end = (t->y - j < t->stripe_rows) ? t->y : j + t->stripe_rows;
+   for (; j < j_end; ++j) {
+      d = t->data + (size_t)(t->flip ? t->y - 1 - j : j) * t->stride;
+      if (j == i * t->stripe_rows) {
+         if (i == 0) {
+            // the first stripe starts where every decoder does
+            prev.color[0] = prev.color[1] = prev.color[2] = 0;
+            prev.color[3] = 255;
+            memset(index, 0, sizeof(index));
+         }
+         else {
+            koiw__qoi_stripe_start(index, &prev, d, t->comp);
+         }
+      }
+      o = encode_row(o, d, t->x, index, &prev, &run);
+   }
+   if (run > 0)
+      *o++ = KOIW_UCHAR(0xc0 | (run - 1)); /* QOI_OP_RUN */
+   t->len[i] = (size_t)(o - (t->out + (size_t)i * t->stripe_cap));
+}
+
+// the stripes followed by the end marker and the stripe table:
+//    u32 offset[count], u32 stripe_rows, u32 count, 'k','o','i','s'
+// all big endian, with offsets counted from the start of the file
+static int koiw__qoi_write_stripes(koi__write_context *s, int x, int y, int comp, const koiw_uc *data, int stride, int stripe_rows)
+{
+   koiw__qoi_stripes t;
+   koiw__dispatch dispatch = koiw__dispatch_current;
+   int i, count;
+   int px_max = (comp == 2 || comp == 4) ? KOIW__QOI_MAX_OP : KOIW__QOI_MAX_OP - 1;
+   size_t offset;
+
+   if (stripe_rows > y)
+      stripe_rows = y;
+   count = (y - 1) / stripe_rows + 1;
+   if ((size_t)x > ((size_t)-1 - 2 * sizeof(size_t)) / px_max / stripe_rows)
+      return koiw__err("too large", "Image too large to split in stripes");
+   // each stripe's part of 'out' is rounded up to keep the lengths after them aligned
+   t.stripe_cap = (size_t)x * stripe_rows * px_max + 1;
+   t.stripe_cap = (t.stripe_cap + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+   if (t.stripe_cap + sizeof(size_t) > (size_t)-1 / count)
+      return koiw__err("too large", "Image too large to split in stripes");
+
+   t.data = data;
+   t.x = x;
+   t.y = y;
+   t.comp = comp;
+   t.stride = stride;
+   t.flip = s->flip;
+   t.stripe_rows = stripe_rows;
+   t.encode_row = koiw__qoi_encode_row[s->qoi_effort > 0][comp - 1];
+   t.out = (koiw_uc*)koiw__malloc((t.stripe_cap + sizeof(size_t)) * count);
+   if (t.out == NULL)
+      return koiw__err("outofmem", "Out of memory");
+   t.len = (size_t*)(void*)(t.out + t.stripe_cap * count);
+
+   if (dispatch.func != NULL && count > 1)
+      dispatch.func(dispatch.context, koiw__qoi_encode_stripe, &t, count);
+   else
+      for (i = 0; i < count; ++i)
+         koiw__qoi_encode_stripe(&t, i);
+
+   for (i = 0; i < count; ++i) {
+      koiw__qoi_count_ops(s->stats, t.out + (size_t)i * t.stripe_cap, t.out + (size_t)i * t.stripe_cap + t.len[i]);
+      koiw__write(s, t.out + (size_t)i * t.stripe_cap, t.len[i]);
+   }
    koiw__writef(s, 1, "11111111", 0, 0, 0, 0, 0, 0, 0, 1);
-#undef KOIW_QOI_COLOR_HASH
+
+   offset = 14;
+   for (i = 0; i < count; ++i) {
+      if (offset > 0xffffffffu) {
+         koiw__free(t.out);
+         return koiw__err("too large", "Image too large for a stripe table");
+      }
+      koiw__put32be(s, (koiw__uint32)offset);
+      offset += t.len[i];
+   }
+   koiw__put32be(s, (koiw__uint32)stripe_rows);
+   koiw__put32be(s, (koiw__uint32)count);
+   koiw__writef(s, 1, "1111", 'k', 'o', 'i', 's');
+   koiw__free(t.out);
+
+   if (s->overflow)
+      return koiw__err("buffer too small", "Output buffer too small for image");
+   koiw__write_flush(s);
+   return 1;
+}
+
+static int koiw__write_qoi_image(koi__write_context *s, int x, int y, int comp, const void *data, int stride)
+{
+   koiw__qoi_state q;
+   int j;
+
+   if (stride == 0)
+      stride = x * comp;
+   else if (stride < x * comp)
+      return koiw__err("bad stride", "Row stride smaller than a row of pixels");
+
+   if (!koiw__qoi_begin(s, &q, x, y, comp))
+      return 0;
+
+   if (s->qoi_stripe_rows > 0 && x > 0 && y > 0)
+      return koiw__qoi_write_stripes(s, x, y, comp, (const koiw_uc*)data, stride, s->qoi_stripe_rows);
+
+   if (s->flip) {
+      for (j = y - 1; j >= 0; --j)
+         if (!koiw__qoi_encode_rows(s, &q, (const koiw_uc*)data + (size_t)j * stride, 1, stride))
+            return 0;
+   }
+   else if (!koiw__qoi_encode_rows(s, &q, (const koiw_uc*)data, y, stride))
+      return 0;
+
+   return koiw__qoi_end(s, &q);
+}
+
+static int koi_write_qoi_core(koi__write_context *s, int x, int y, int comp, const void *data, int stride)
+{
+   int r;
+   koiw__resolve_settings(s);
+   KOIW__STATS_TIME(s->stats, encode_seconds, r = koiw__write_qoi_image(s, x, y, comp, data, stride));
+   return r;
+}
+
+static int koiw__qoi_bound(int x, int y, int comp, int stripe_rows)
+{
+   // every pixel either extends a run or becomes a single chunk, which is at
+   // most QOI_OP_RGBA, or QOI_OP_RGB if the image has no alpha
+   int px_max = (comp == 2 || comp == 4) ? KOIW__QOI_MAX_OP : KOIW__QOI_MAX_OP - 1;
+   int table = 0;
+
+   if (x < 0 || y < 0 || comp < 1 || comp > 4)
+      return 0;
+   if (stripe_rows > 0 && x > 0 && y > 0) {
+      // and the stripe table after the end marker
+      if (stripe_rows > y)
+         stripe_rows = y;
+      table = ((y - 1) / stripe_rows + 1) * 4 + 12;
+   }
+   if (y > 0 && x > (INT_MAX - 14 - 8 - table) / px_max / y)
+      return 0;
+   return 14 + x * y * px_max + 8 + table; // header, chunks, end marker
+}
+
+KOIWDEF int koi_write_qoi_bound(int x, int y, int comp)
+{
+   return koiw__qoi_bound(x, y, comp, koi__qoi_stripe_rows_on_write);
+}
+
+#undef KOIW__QOI_MAX_OP
+
+struct koi_qoi_encoder
+{
+   koi__write_context s;
+   koiw__qoi_state q;
+   int failed;
+};
+
+KOIWDEF koi_qoi_encoder *koi_qoi_encoder_begin(koi_write_func *func, void *context, int w, int h, int comp)
+{
+   koi_qoi_encoder *e = (koi_qoi_encoder*)koiw__malloc(sizeof(*e));
+   if (e == NULL) {
+      koiw__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   koi__start_write_callbacks(&e->s, func, context);
+   koiw__resolve_settings(&e->s);
+   e->failed = 0;
+   if (!koiw__qoi_begin(&e->s, &e->q, w, h, comp)) {
+      koiw__free(e);
+      return NULL;
+   }
+   return e;
+}
+
+KOIWDEF int koi_qoi_encoder_push_rows(koi_qoi_encoder *e, const void *rows, int num_rows, int stride_in_bytes)
+{
+   int row_bytes = e->q.x * e->q.comp;
+
+   if (e->failed)
+      return 0;
+   if (num_rows < 0 || num_rows > e->q.y - e->q.rows_done)
+      return koiw__err("too many rows", "More rows pushed than the image has");
+   if (stride_in_bytes == 0)
+      stride_in_bytes = row_bytes;
+   else if (stride_in_bytes < row_bytes)
+      return koiw__err("bad stride", "Row stride smaller than a row of pixels");
+
+   KOIW__STATS_TIME(e->s.stats, encode_seconds, e->failed = !koiw__qoi_encode_rows(&e->s, &e->q, (const koiw_uc*)rows, num_rows, stride_in_bytes));
+   return !e->failed;
+}
+
+KOIWDEF int koi_qoi_encoder_end(koi_qoi_encoder *e)
+{
+   int r;
+   if (e == NULL)
+      return 0;
+   if (e->failed)
+      r = 0;
+   else if (e->q.rows_done != e->q.y)
+      r = koiw__err("missing rows", "Fewer rows pushed than the image has");
+   else
+      KOIW__STATS_TIME(e->s.stats, encode_seconds, r = koiw__qoi_end(&e->s, &e->q));
+   if (!r)
+      koiw__write_flush(&e->s); // hand over what was encoded anyway
+   koiw__free(e);
+   return r;
+}
+
+// the frames of an animation share the QOI state, so each one starts with
+// the index and previous pixel the one before it left. key frames start
+// from scratch, so decoding can begin at any of them
+struct koi_qoi_anim_encoder
+{
+   koi__write_context s;
+   koiw__qoi_state q;
+   koiw_uc *prev;        // the frame added last, tightly packed
+   koiw__uint32 *offset; // where each frame starts
+   int count, cap;
+   int keyframe_interval, since_key, failed;
+};
+
+KOIWDEF koi_qoi_anim_encoder *koi_qoi_anim_begin(koi_write_func *func, void *context, int w, int h, int comp, int keyframe_interval)
+{
+   koi_qoi_anim_encoder *e;
+   size_t size;
+
+   if (!koiw__qoi_check(w, h, comp))
+      return NULL;
+   if (h > 0 && (size_t)w * comp > (size_t)-1 / h) {
+      koiw__err("too large", "Image too large to keep a copy of");
+      return NULL;
+   }
+   size = (size_t)w * h * comp;
+   e = (koi_qoi_anim_encoder*)koiw__malloc(sizeof(*e));
+   if (e == NULL) {
+      koiw__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   e->prev = (koiw_uc*)koiw__malloc(size ? size : 1);
+   if (e->prev == NULL) {
+      koiw__free(e);
+      koiw__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   koi__start_write_callbacks(&e->s, func, context);
+   koiw__resolve_settings(&e->s);
+   e->offset = NULL;
+   e->count = e->cap = 0;
+   e->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 0;
+   e->since_key = 0;
+   e->failed = 0;
+   e->q.x = w;
+   e->q.y = h;
+   e->q.comp = comp;
+   e->q.rows_done = 0;
+   e->q.encode_row = koiw__qoi_encode_row[e->s.qoi_effort > 0][comp - 1];
+
+   koiw__writef(&e->s, 1, "1111 44 11 11", 'k', 'o', 'i', 'a', w, h, (comp == 2 || comp == 4) ? 4 : 3, e->s.qoi_color_space != 0 ? 1 : 0, 0, 0);
+   return e;
+}
+
+// a frame is a flags byte (1 for a key frame) and then spans of rows until
+// all of them are covered: u32 rows kept from the frame before, u32 rows
+// that follow as QOI chunks. a span never ends inside a run
+static int koiw__qoi_anim_frame(koi_qoi_anim_encoder *e, const koiw_uc *data, int stride)
+{
+   koiw__qoi_state *q = &e->q;
+   size_t row_bytes = (size_t)q->x * q->comp, pos = e->s.flushed + e->s.buf_used;
+   koiw__uint32 *grown;
+   int key = e->count == 0 || (e->keyframe_interval && e->since_key >= e->keyframe_interval);
+   int j, j0, j1;
+
+   if (pos > 0xffffffffu)
+      return koiw__err("too large", "Animation too large for a frame table");
+   if (e->count == e->cap) {
+      if (e->cap > (INT_MAX >> 1) / (int)sizeof(*e->offset))
+         return koiw__err("too large", "Too many frames");
+      grown = (koiw__uint32*)koiw__malloc(sizeof(*grown) * (e->cap ? e->cap * 2 : 64));
+      if (grown == NULL)
+         return koiw__err("outofmem", "Out of memory");
+      if (e->count) memcpy(grown, e->offset, sizeof(*grown) * e->count);
+      koiw__free(e->offset);
+      e->offset = grown;
+      e->cap = e->cap ? e->cap * 2 : 64;
+   }
+   e->offset[e->count++] = (koiw__uint32)pos;
+
+   koiw__write1(&e->s, KOIW_UCHAR(key));
+   if (key) {
+      koiw__qoi_reset(q);
+      e->since_key = 0;
+   }
+   ++e->since_key;
+
+   for (j = 0; j < q->y; ) {
+      for (j0 = j; !key && j < q->y && memcmp(e->prev + j * row_bytes, data + (size_t)j * stride, row_bytes) == 0; ++j)
+         ;
+      for (j1 = j; j < q->y && (key || memcmp(e->prev + j * row_bytes, data + (size_t)j * stride, row_bytes) != 0); ++j)
+         memcpy(e->prev + j * row_bytes, data + (size_t)j * stride, row_bytes);
+      koiw__put32be(&e->s, (koiw__uint32)(j1 - j0));
+      koiw__put32be(&e->s, (koiw__uint32)(j - j1));
+      if (!koiw__qoi_encode_rows(&e->s, q, data + (size_t)j1 * stride, j - j1, stride))
+         return 0;
+      koiw__qoi_flush_run(&e->s, q);
+   }
    return 1;
 }
 
+KOIWDEF int koi_qoi_anim_add_frame(koi_qoi_anim_encoder *e, const void *data, int stride_in_bytes)
+{
+   int row_bytes = e->q.x * e->q.comp;
+
+   if (e->failed)
+      return 0;
+   if (stride_in_bytes == 0)
+      stride_in_bytes = row_bytes;
+   else if (stride_in_bytes < row_bytes)
+      return koiw__err("bad stride", "Row stride smaller than a row of pixels");
+
+   KOIW__STATS_TIME(e->s.stats, encode_seconds, e->failed = !koiw__qoi_anim_frame(e, (const koiw_uc*)data, stride_in_bytes));
+   return !e->failed;
+}
+
+// the frames are followed by u32 offset[count], u32 count, 'k','o','i','f',
+// all big endian, with offsets counted from the start of the file
+KOIWDEF int koi_qoi_anim_end(koi_qoi_anim_encoder *e)
+{
+   int i, r = 0;
+   if (e == NULL)
+      return 0;
+   if (!e->failed) {
+      for (i = 0; i < e->count; ++i)
+         koiw__put32be(&e->s, e->offset[i]);
+      koiw__put32be(&e->s, (koiw__uint32)e->count);
+      koiw__writef(&e->s, 1, "1111", 'k', 'o', 'i', 'f');
+      r = 1;
+   }
+   koiw__write_flush(&e->s);
+   koiw__free(e->offset);
+   koiw__free(e->prev);
+   koiw__free(e);
+   return r;
+}
+
+struct koi_encoder
+{
+   koi__write_context s; // with the output buffer in it; set up again for every image
+   int flip, qoi_color_space, qoi_stripe_rows, qoi_effort;
+};
+
+KOIWDEF koi_encoder *koi_encoder_create(void)
+{
+   koi_encoder *e = (koi_encoder*)koiw__malloc(sizeof(*e));
+   if (e == NULL) {
+      koiw__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   e->flip = 0;
+   e->qoi_color_space = 0;
+   e->qoi_stripe_rows = 0;
+   e->qoi_effort = 1;
+   return e;
+}
+
+KOIWDEF void koi_encoder_free(koi_encoder *e)
+{
+   koiw__free(e);
+}
+
+KOIWDEF void koi_encoder_set_flip_vertically(koi_encoder *e, int flag_true_if_should_flip)
+{
+   e->flip = flag_true_if_should_flip != 0;
+}
+
+KOIWDEF void koi_encoder_set_qoi_color_space(koi_encoder *e, int qoi_color_space)
+{
+   e->qoi_color_space = qoi_color_space;
+}
+
+KOIWDEF void koi_encoder_set_qoi_stripe_rows(koi_encoder *e, int rows_per_stripe)
+{
+   e->qoi_stripe_rows = rows_per_stripe > 0 ? rows_per_stripe : 0;
+}
+
+KOIWDEF void koi_encoder_set_qoi_effort(koi_encoder *e, int effort)
+{
+   e->qoi_effort = effort > 0 ? 1 : 0;
+}
+
+static void koiw__encoder_settings(koi_encoder *e)
+{
+   e->s.flip = e->flip;
+   e->s.qoi_color_space = e->qoi_color_space;
+   e->s.qoi_stripe_rows = e->qoi_stripe_rows;
+   e->s.qoi_effort = e->qoi_effort;
+}
+
+KOIWDEF int koi_encoder_qoi_bound(koi_encoder *e, int w, int h, int comp)
+{
+   return koiw__qoi_bound(w, h, comp, e->qoi_stripe_rows);
+}
+
+KOIWDEF int koi_encoder_write_qoi_to_func(koi_encoder *e, koi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes)
+{
+   koi__start_write_callbacks(&e->s, func, context);
+   koiw__encoder_settings(e);
+   return koi_write_qoi_core(&e->s, w, h, comp, data, stride_in_bytes);
+}
+
+KOIWDEF int koi_encoder_write_qoi_to_memory(koi_encoder *e, void *dst, int capacity, int w, int h, int comp, const void *data, int stride_in_bytes)
+{
+   if (dst == NULL || capacity < 0)
+      return koiw__err("bad buffer", "Invalid output buffer");
+   koi__start_write_memory(&e->s, dst, capacity);
+   koiw__encoder_settings(e);
+   if (!koi_write_qoi_core(&e->s, w, h, comp, data, stride_in_bytes))
+      return 0;
+   return e->s.buf_used;
+}
+
+KOIWDEF int koi_write_qoi_to_memory(void *dst, int capacity, int x, int y, int comp, const void *data)
+{
+   return koi_write_qoi_stride_to_memory(dst, capacity, x, y, comp, data, 0);
+}
+
+KOIWDEF int koi_write_qoi_stride_to_memory(void *dst, int capacity, int x, int y, int comp, const void *data, int stride_in_bytes)
+{
+   koi__write_context s;
+   if (dst == NULL || capacity < 0)
+      return koiw__err("bad buffer", "Invalid output buffer");
+   koi__start_write_memory(&s, dst, capacity);
+   if (!koi_write_qoi_core(&s, x, y, comp, data, stride_in_bytes))
+      return 0;
+   return s.buf_used;
+}
+
 KOIWDEF int koi_write_qoi_to_func(koi_write_func *func, void *context, int x, int y, int comp, const void *data)
+{
+   return koi_write_qoi_stride_to_func(func, context, x, y, comp, data, 0);
+}
+
+KOIWDEF int koi_write_qoi_stride_to_func(koi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_in_bytes)
 {
    koi__write_context s;
    koi__start_write_callbacks(&s, func, context);
-   return koi_write_qoi_core(&s, x, y, comp, data);
+   return koi_write_qoi_core(&s, x, y, comp, data, stride_in_bytes);
 }
 
 #if !defined(KOI_WRITE_NO_STDIO)
 KOIWDEF int koi_write_qoi(char const *filename, int x, int y, int comp, const void *data)
+{
+   return koi_write_qoi_stride(filename, x, y, comp, data, 0);
+}
+
+KOIWDEF int koi_write_qoi_stride(char const *filename, int x, int y, int comp, const void *data, int stride_in_bytes)
 {
    koi__write_context s;
    if (koi__start_write_file(&s, filename)) {
-      int r = koi_write_qoi_core(&s, x, y, comp, data);
+      int r = koi_write_qoi_core(&s, x, y, comp, data, stride_in_bytes);
       koi__end_write_file(&s);
       return r;
    }
@@ -0,0 +1,33 @@
+#include "koi.hpp"
+#include <vector>
+#include <array>
+#include <cstdio>
+#include <cstring>
+int main() {
+  std::vector<unsigned char> px(16*8*4);
+  for (size_t i=0;i<px.size();++i) px[i]=(unsigned char)(i*7);
+  koi::image_view v; v.data=px.data(); v.width=16; v.height=8; v.channels=4;
+  std::vector<unsigned char> out;
+  auto n = koi::encode(out, v);
+  if (!n) { std::puts(n.error()); return 1; }
+  auto r = koi::load(out, 4);
+  if (!r) { std::puts(r.error()); return 1; }
+  koi::image img = std::move(r).value();
+  if (std::memcmp(img.data(), px.data(), px.size())) { std::puts("mismatch"); return 1; }
+  std::vector<unsigned char> dst(px.size());
+  auto i = koi::decode_into(out, dst, 4);
+  if (!i || i->width != 16) { std::puts("decode_into fail"); return 1; }
+  std::vector<float> fd(px.size());
+  auto j = koi::decode_into(out, fd, 4);
+  if (!j) { std::puts(j.error()); return 1; }
+  std::array<unsigned char, 4096> fixed{};
+  auto m = koi::encode_into(fixed, img.view());
+  if (!m || *&m.value() != out.size()) { std::puts("encode_into"); return 1; }
+  koi::span<const unsigned char> s1(out);
+  koi::span<const unsigned char> s2 = koi::span<unsigned char>(out);
+  (void)s1;(void)s2;
+  auto bad = koi::load(std::vector<unsigned char>{1,2,3});
+  std::printf("ok %zu %s\n", (size_t)n.value(), bad.error());
+  static_assert(koi::rgba8.bytes_per_pixel()==4, "");
+  return 0;
+}